@@ -0,0 +1,184 @@
+/*
+ * simplecpp - A simple and high-fidelity C/C++ preprocessor library
+ * Copyright (C) 2016-2023 simplecpp team
+ */
+
+#define SIMPLECPP_TOKENLIST_ALLOW_PTR 1
+#include "simplecpp.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/** generates a deterministic source file with a mix of the things the lexer handles */
+static std::string generateCode(std::size_t size)
+{
+    std::string code;
+    code.reserve(size + 1024U);
+    for (unsigned int i = 0; code.size() < size; ++i) {
+        const std::string n = std::to_string(i);
+        code += "/**\n"
+                " * Documentation for function" + n + ".\n"
+                " * @param a first value\n"
+                " */\n"
+                "#define MAX" + n + "(a, b) ((a) > (b) ? (a) : (b)) \\\n"
+                "    /* continued */\n"
+                "static int function" + n + "(int a, const char *s)\n"
+                "{\n"
+                "    // line comment " + n + "\n"
+                "    static const unsigned long long table[] = { 0x" + n + "ULL, 1.5e+3, 'c', 1'000 };\n"
+                "    if (a >= " + n + " && s != nullptr) {\n"
+                "        a <<= 2; a -= MAX" + n + "(a, 3) * sizeof(table);\n"
+                "        return a++ + s[0] - u8\"text \\\" " + n + "\" [0];\n"
+                "    }\n"
+                "    const char *r = R\"x(raw \" string)x\";\n"
+                "    return a->b::c;\n"
+                "}\n"
+                "#if defined(FEATURE" + n + ") || FEATURE" + n + " > 2\n"
+                "#include <header" + n + ".h>\n"
+                "#endif\n";
+    }
+    return code;
+}
+
+/** UTF-16LE with byte order mark */
+static std::string toUtf16(const std::string &code)
+{
+    std::string ret("\xff\xfe", 2);
+    ret.reserve(2U + 2U * code.size());
+    for (const char c : code) {
+        ret += c;
+        ret += '\0';
+    }
+    return ret;
+}
+
+/** best of the runs in milliseconds */
+static double measure(unsigned int runs, const std::function<std::size_t()> &lex, std::size_t &tokens)
+{
+    double best = 0;
+    for (unsigned int run = 0; run < runs; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        tokens = lex();
+        const auto stop = std::chrono::steady_clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(stop - start).count();
+        if (run == 0 || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static std::size_t countTokens(const simplecpp::TokenList &tokens)
+{
+    std::size_t count = 0;
+    for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next)
+        ++count;
+    return count;
+}
+
+static void report(const char name[], std::size_t bytes, double ms, std::size_t tokens)
+{
+    const double mib = bytes / (1024.0 * 1024.0);
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << mib << " MiB"
+              << std::setw(10) << ms << " ms"
+              << std::setw(10) << (mib * 1000.0 / ms) << " MiB/s"
+              << std::setw(12) << tokens << " tokens" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t size = 16U;
+    unsigned int runs = 3U;
+    unsigned int threads = 4U;
+    std::string filename = "benchmark_input.c";
+
+    for (int i = 1; i < argc; i++) {
+        const char * const arg = argv[i];
+        if (arg[0] == '-' && arg[1] == 's' && std::atoi(arg + 2) > 0)
+            size = std::atoi(arg + 2);
+        else if (arg[0] == '-' && arg[1] == 'r' && std::atoi(arg + 2) > 0)
+            runs = std::atoi(arg + 2);
+        else if (arg[0] == '-' && arg[1] == 'j' && std::atoi(arg + 2) > 0)
+            threads = std::atoi(arg + 2);
+        else if (arg[0] == '-' && arg[1] == 'o' && arg[2])
+            filename = arg + 2;
+        else {
+            std::cout << "Syntax:" << std::endl;
+            std::cout << "benchmark [options]" << std::endl;
+            std::cout << "  -sN             Lex N MiB of generated code (default 16)." << std::endl;
+            std::cout << "  -rN             Report the best of N runs (default 3)." << std::endl;
+            std::cout << "  -jN             Also lex the file with N threads (default 4)." << std::endl;
+            std::cout << "  -oFILE          Write the generated code to FILE (default benchmark_input.c)." << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string code = generateCode(size * 1024U * 1024U);
+    const std::string utf16 = toUtf16(code);
+    {
+        std::ofstream f(filename, std::ios::binary);
+        f << code;
+    }
+
+    std::size_t tokens = 0;
+    double ms;
+
+    ms = measure(runs, [&]() {
+        std::vector<std::string> files;
+        const simplecpp::TokenList list(reinterpret_cast<const unsigned char *>(code.data()), code.size(), files, filename);
+        return countTokens(list);
+    }, tokens);
+    report("buffer", code.size(), ms, tokens);
+
+    ms = measure(runs, [&]() {
+        std::vector<std::string> files;
+        std::istringstream istr(code);
+        const simplecpp::TokenList list(istr, files, filename);
+        return countTokens(list);
+    }, tokens);
+    report("istream", code.size(), ms, tokens);
+
+    ms = measure(runs, [&]() {
+        std::vector<std::string> files;
+        const simplecpp::TokenList list(filename, files);
+        return countTokens(list);
+    }, tokens);
+    report("file", code.size(), ms, tokens);
+
+    ms = measure(runs, [&]() {
+        std::vector<std::string> files;
+        const simplecpp::TokenList list(filename, files, nullptr, true);
+        return countTokens(list);
+    }, tokens);
+    report("file, skip comments", code.size(), ms, tokens);
+
+    if (threads > 1U) {
+        ms = measure(runs, [&]() {
+            std::vector<std::string> files;
+            const simplecpp::TokenList list(filename, files, nullptr, false, threads);
+            return countTokens(list);
+        }, tokens);
+        const std::string name = "file, " + std::to_string(threads) + " threads";
+        report(name.c_str(), code.size(), ms, tokens);
+    }
+
+    ms = measure(runs, [&]() {
+        std::vector<std::string> files;
+        const simplecpp::TokenList list(reinterpret_cast<const unsigned char *>(utf16.data()), utf16.size(), files, filename);
+        return countTokens(list);
+    }, tokens);
+    report("buffer, utf-16", utf16.size(), ms, tokens);
+
+    std::remove(filename.c_str());
+    return 0;
+}
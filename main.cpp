@@ -29,8 +29,10 @@ int main(int argc, char **argv)
     bool error = false;
     const char *filename = nullptr;
     bool use_istream = false;
+    bool use_stream = false;
     bool fail_on_error = false;
     bool linenrs = false;
+    int threads = 1;
 
     // Settings..
     simplecpp::DUI dui;
@@ -101,6 +103,9 @@ int main(int argc, char **argv)
                         break;
                     }
                     dui.std = std::move(value);
+                } else if (std::strcmp(arg, "-stream")==0) {
+                    found = true;
+                    use_stream = true;
                 }
                 break;
             case 'q':
@@ -119,6 +124,14 @@ int main(int argc, char **argv)
                 linenrs = true;
                 found = true;
                 break;
+            case 'j':
+                found = true;
+                threads = std::atoi(arg + 2);
+                if (threads <= 0) {
+                    std::cout << "error: option -j with invalid value." << std::endl;
+                    error = true;
+                }
+                break;
             }
             if (!found) {
                 std::cout << "error: option '" << arg << "' is unknown." << std::endl;
@@ -153,6 +166,8 @@ int main(int argc, char **argv)
         std::cout << "  -e              Output errors only." << std::endl;
         std::cout << "  -f              Fail when errors were encountered (exitcode 1)." << std::endl;
         std::cout << "  -l              Print lines numbers." << std::endl;
+        std::cout << "  -jN             Lex a large file with N threads." << std::endl;
+        std::cout << "  -stream         Lex the file while it is preprocessed (-jN is ignored)." << std::endl;
         return 0;
     }
 
@@ -187,15 +202,26 @@ int main(int argc, char **argv)
     simplecpp::OutputList outputList;
     std::vector<std::string> files;
     simplecpp::TokenList outputTokens(files);
-    {
+    if (use_stream) {
+        simplecpp::TokenStream *rawtokens;
+        if (use_istream) {
+            rawtokens = new simplecpp::TokenStream(f, files,filename,&outputList,true);
+        } else {
+            f.close();
+            rawtokens = new simplecpp::TokenStream(filename,files,&outputList,true);
+        }
+        simplecpp::FileDataCache filedata;
+        simplecpp::preprocess(outputTokens, *rawtokens, files, filedata, dui, &outputList);
+        simplecpp::cleanup(filedata);
+        delete rawtokens;
+    } else {
         simplecpp::TokenList *rawtokens;
         if (use_istream) {
-            rawtokens = new simplecpp::TokenList(f, files,filename,&outputList);
+            rawtokens = new simplecpp::TokenList(f, files,filename,&outputList,true);
         } else {
             f.close();
-            rawtokens = new simplecpp::TokenList(filename,files,&outputList);
+            rawtokens = new simplecpp::TokenList(filename,files,&outputList,true,threads);
         }
-        rawtokens->removeComments();
         simplecpp::FileDataCache filedata;
         simplecpp::preprocess(outputTokens, *rawtokens, files, filedata, dui, &outputList);
         simplecpp::cleanup(filedata);
@@ -33,29 +33,32 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <istream>
 #include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <set>
 #include <sstream>
 #include <stack>
 #include <stdexcept>
 #include <string>
-#ifdef SIMPLECPP_WINDOWS
-#  include <mutex>
-#endif
+#include <system_error>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #ifdef _WIN32
 #  include <direct.h>
-#else
-#  include <sys/stat.h>
 #endif
+#include <sys/stat.h>
 
 static bool isHex(const std::string &s)
 {
@@ -81,27 +84,6 @@ static bool isCharLiteral_(const std::string &s)
     return s.size() > 1 && (s[0]=='\'') && (*s.rbegin()=='\'');
 }
 
-static const simplecpp::TokenString DEFINE("define");
-static const simplecpp::TokenString UNDEF("undef");
-
-static const simplecpp::TokenString INCLUDE("include");
-
-static const simplecpp::TokenString ERROR("error");
-static const simplecpp::TokenString WARNING("warning");
-
-static const simplecpp::TokenString IF("if");
-static const simplecpp::TokenString IFDEF("ifdef");
-static const simplecpp::TokenString IFNDEF("ifndef");
-static const simplecpp::TokenString DEFINED("defined");
-static const simplecpp::TokenString ELSE("else");
-static const simplecpp::TokenString ELIF("elif");
-static const simplecpp::TokenString ENDIF("endif");
-
-static const simplecpp::TokenString PRAGMA("pragma");
-static const simplecpp::TokenString ONCE("once");
-
-static const simplecpp::TokenString HAS_INCLUDE("__has_include");
-
 template<class T> static std::string toString(T t)
 {
     // NOLINTNEXTLINE(misc-const-correctness) - false positive
@@ -183,19 +165,382 @@ static std::string replaceAll(std::string s, const std::string& from, const std:
 
 void simplecpp::Location::adjust(const std::string &str)
 {
-    if (strpbrk(str.c_str(), "\r\n") == nullptr) {
+    std::string::size_type pos = str.find_first_of("\r\n");
+    if (pos == std::string::npos) {
         col += str.size();
         return;
     }
 
-    for (std::size_t i = 0U; i < str.size(); ++i) {
-        col++;
-        if (str[i] == '\n' || str[i] == '\r') {
-            col = 1;
-            line++;
-            if (str[i] == '\r' && (i+1)<str.size() && str[i+1]=='\n')
-                ++i;
+    // jump from newline to newline, the column only depends on the last line
+    std::string::size_type start;
+    do {
+        line++;
+        if (str[pos] == '\r' && (pos+1)<str.size() && str[pos+1]=='\n')
+            ++pos;
+        start = pos + 1;
+        pos = str.find_first_of("\r\n", start);
+    } while (pos != std::string::npos);
+    col = 1 + (str.size() - start);
+}
+
+/** the interned strings, in shards with their own lock so the lexer threads rarely wait for each other */
+struct simplecpp::InternedString::Table {
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_multimap<std::size_t, Entry *> entries;
+    };
+
+    Shard &shard(std::size_t hash) {
+        return shards[hash % SHARDS];
+    }
+
+    static const std::size_t SHARDS = 64U;
+    Shard shards[SHARDS];
+};
+
+simplecpp::InternedString::Table &simplecpp::InternedString::table()
+{
+    // never destroyed, tokens in static objects can outlive it otherwise
+    static Table * const t = new Table;
+    return *t;
+}
+
+const std::string &simplecpp::InternedString::emptyString()
+{
+    static const std::string empty;
+    return empty;
+}
+
+static simplecpp::keyword_t classifyKeyword(const std::string &s)
+{
+    // the length and the first character select at most one candidate
+    struct Candidate {
+        const char *str;
+        simplecpp::keyword_t keyword;
+    };
+    Candidate c{nullptr, simplecpp::KwNone};
+    switch (s.size()) {
+    case 2:
+        if (s[0] == 'i')
+            c = {"if", simplecpp::KwIf};
+        else if (s[0] == 'o')
+            c = {"or", simplecpp::KwOr};
+        break;
+    case 3:
+        if (s[0] == 'a')
+            c = {"and", simplecpp::KwAnd};
+        else if (s[0] == 'n')
+            c = {"not", simplecpp::KwNot};
+        else if (s[0] == 'x')
+            c = {"xor", simplecpp::KwXor};
+        break;
+    case 4:
+        if (s[0] == 'o')
+            c = {"once", simplecpp::KwOnce};
+        else if (s[0] == 'e')
+            c = (s[1] == 'l' && s[2] == 's') ? Candidate{"else", simplecpp::KwElse} : Candidate{"elif", simplecpp::KwElif};
+        break;
+    case 5:
+        if (s[0] == 'u')
+            c = {"undef", simplecpp::KwUndef};
+        else if (s[0] == 'i')
+            c = {"ifdef", simplecpp::KwIfdef};
+        else if (s[0] == 'e')
+            c = (s[1] == 'r') ? Candidate{"error", simplecpp::KwError} : Candidate{"endif", simplecpp::KwEndif};
+        else if (s[0] == 'b')
+            c = {"bitor", simplecpp::KwBitor};
+        else if (s[0] == 'c')
+            c = {"compl", simplecpp::KwCompl};
+        break;
+    case 6:
+        if (s[0] == 'd')
+            c = {"define", simplecpp::KwDefine};
+        else if (s[0] == 'i')
+            c = {"ifndef", simplecpp::KwIfndef};
+        else if (s[0] == 'p')
+            c = {"pragma", simplecpp::KwPragma};
+        else if (s[0] == 'b')
+            c = {"bitand", simplecpp::KwBitand};
+        else if (s[0] == 'n')
+            c = {"not_eq", simplecpp::KwNotEq};
+        break;
+    case 7:
+        if (s[0] == 'i')
+            c = {"include", simplecpp::KwInclude};
+        else if (s[0] == 'w')
+            c = {"warning", simplecpp::KwWarning};
+        else if (s[0] == 'd')
+            c = {"defined", simplecpp::KwDefined};
+        break;
+    case 8:
+        if (s[2] == 'F')
+            c = {"__FILE__", simplecpp::KwFile};
+        else if (s[2] == 'L')
+            c = {"__LINE__", simplecpp::KwLine};
+        break;
+    case 11:
+        c = {"__COUNTER__", simplecpp::KwCounter};
+        break;
+    case 13:
+        c = {"__has_include", simplecpp::KwHasInclude};
+        break;
+    }
+    return (c.str && s == c.str) ? c.keyword : simplecpp::KwNone;
+}
+
+simplecpp::InternedString::InternedString(const std::string &s)
+{
+    if (s.empty())
+        return;
+    const std::size_t hash = std::hash<std::string>()(s);
+
+    // the strings this thread interned last are found again without the lock
+    static const std::size_t CACHE_SIZE = 1024U;
+    static thread_local InternedString cache[CACHE_SIZE];
+    InternedString &cached = cache[hash % CACHE_SIZE];
+    if (cached.mEntry && cached.mEntry->hash == hash && cached.mEntry->str == s) {
+        mEntry = cached.mEntry;
+        mEntry->refs.fetch_add(1U, std::memory_order_relaxed);
+        return;
+    }
+
+    {
+        Table::Shard &shard = table().shard(hash);
+        const std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto range = shard.entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second->str == s) {
+                mEntry = it->second;
+                mEntry->refs.fetch_add(1U, std::memory_order_relaxed);
+                break;
+            }
+        }
+        if (!mEntry) {
+            mEntry = new Entry(s, hash, classifyKeyword(s));
+            shard.entries.emplace(hash, mEntry);
+        }
+    }
+    cached = *this;
+}
+
+std::ostream &simplecpp::operator<<(std::ostream &os, const InternedString &s)
+{
+    return os << s.str();
+}
+
+void simplecpp::InternedString::release()
+{
+    unsigned int refs = mEntry->refs.load(std::memory_order_relaxed);
+    while (refs > 1U) {
+        if (mEntry->refs.compare_exchange_weak(refs, refs - 1U, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            mEntry = nullptr;
+            return;
+        }
+    }
+
+    // The last reference is dropped with the lock held, a lookup that finds
+    // the entry adds its reference with the lock held too.
+    Table::Shard &shard = table().shard(mEntry->hash);
+    const std::lock_guard<std::mutex> lock(shard.mutex);
+    if (mEntry->refs.fetch_sub(1U, std::memory_order_acq_rel) == 1U) {
+        const auto range = shard.entries.equal_range(mEntry->hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == mEntry) {
+                shard.entries.erase(it);
+                break;
+            }
+        }
+        delete mEntry;
+    }
+    mEntry = nullptr;
+}
+
+// AddressSanitizer can only find a use of a deleted token when the memory
+// goes back to the system allocator.
+#if defined(__SANITIZE_ADDRESS__)
+#  define SIMPLECPP_TOKEN_POOL 0
+#elif defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define SIMPLECPP_TOKEN_POOL 0
+#  endif
+#endif
+#ifndef SIMPLECPP_TOKEN_POOL
+#  define SIMPLECPP_TOKEN_POOL 1
+#endif
+
+#if SIMPLECPP_TOKEN_POOL
+namespace {
+    /**
+     * Deleted tokens are kept for reuse. Each thread keeps a cache of free
+     * tokens and exchanges them with the shared pool in batches, so the lock
+     * is only taken once per batch. The pool keeps a limited number of
+     * batches, the tokens beyond that go back to the system allocator.
+     */
+    class TokenPool {
+    public:
+        struct FreeToken {
+            FreeToken *next;
+        };
+        struct Batch {
+            FreeToken *head;
+            std::size_t size;
+        };
+
+        static const std::size_t BATCH_SIZE = 256U;
+        static const std::size_t MAX_BATCHES = 64U;
+
+        /**
+         * take a batch of free tokens. If there are none, the tokens of a new
+         * batch are allocated one after another, so they are close in memory
+         * and can still be freed one by one.
+         */
+        Batch take() {
+            if (count.load(std::memory_order_relaxed) != 0U) {
+                const std::lock_guard<std::mutex> lock(mutex);
+                if (!batches.empty()) {
+                    const Batch batch = batches.back();
+                    batches.pop_back();
+                    tokens -= batch.size;
+                    count.store(batches.size(), std::memory_order_relaxed);
+                    return batch;
+                }
+            }
+            // only the first allocation throws, a shorter batch is fine
+            FreeToken *head = nullptr;
+            FreeToken **tail = &head;
+            std::size_t size = 0;
+            for (; size < BATCH_SIZE; ++size) {
+                void * const p = size == 0U ? ::operator new(sizeof(simplecpp::Token)) : ::operator new(sizeof(simplecpp::Token), std::nothrow);
+                if (!p)
+                    break;
+                *tail = static_cast<FreeToken *>(p);
+                tail = &(*tail)->next;
+            }
+            *tail = nullptr;
+            return Batch{head, size};
+        }
+
+        void put(const Batch &batch) {
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                if (batches.size() < MAX_BATCHES) {
+                    batches.push_back(batch);
+                    tokens += batch.size;
+                    count.store(batches.size(), std::memory_order_relaxed);
+                    return;
+                }
+            }
+            for (FreeToken *tok = batch.head; tok;) {
+                FreeToken * const next = tok->next;
+                ::operator delete(tok);
+                tok = next;
+            }
+        }
+
+        std::size_t size() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            return tokens;
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<Batch> batches;
+        /** number of tokens in batches */
+        std::size_t tokens{};
+        std::atomic<std::size_t> count{};
+    };
+
+    TokenPool &tokenPool()
+    {
+        // never destroyed, tokens in static objects can be deleted after it otherwise
+        static TokenPool * const pool = new TokenPool;
+        return *pool;
+    }
+
+    struct TokenCache {
+        TokenCache() = default;
+        TokenCache(const TokenCache &) = delete;
+        ~TokenCache();
+        TokenCache &operator=(const TokenCache &) = delete;
+
+        TokenPool::FreeToken *head{};
+        std::size_t size{};
+    };
+
+    thread_local TokenCache tokenCache;
+    // the tokens that are deleted after tokenCache has been destroyed are not cached
+    thread_local bool tokenCacheDestroyed = false;
+
+    TokenCache::~TokenCache()
+    {
+        if (head)
+            tokenPool().put(TokenPool::Batch{head, size});
+        tokenCacheDestroyed = true;
+    }
+}
+#endif
+
+void *simplecpp::Token::operator new(std::size_t size)
+{
+#if SIMPLECPP_TOKEN_POOL
+    if (size == sizeof(Token) && !tokenCacheDestroyed) {
+        TokenCache &cache = tokenCache;
+        if (!cache.head) {
+            const TokenPool::Batch batch = tokenPool().take();
+            cache.head = batch.head;
+            cache.size = batch.size;
+        }
+        TokenPool::FreeToken * const ret = cache.head;
+        cache.head = ret->next;
+        --cache.size;
+        return ret;
+    }
+#endif
+    return ::operator new(size);
+}
+
+void simplecpp::Token::operator delete(void *p, std::size_t size)
+{
+#if SIMPLECPP_TOKEN_POOL
+    if (size == sizeof(Token) && !tokenCacheDestroyed) {
+        TokenCache &cache = tokenCache;
+        TokenPool::FreeToken * const tok = static_cast<TokenPool::FreeToken *>(p);
+        tok->next = cache.head;
+        cache.head = tok;
+        // hand a batch back to the pool, the tokens might be needed by another thread
+        if (++cache.size == 2U * TokenPool::BATCH_SIZE) {
+            TokenPool::FreeToken *last = cache.head;
+            for (std::size_t i = 1U; i < TokenPool::BATCH_SIZE; ++i)
+                last = last->next;
+            TokenPool::FreeToken * const batch = cache.head;
+            cache.head = last->next;
+            cache.size -= TokenPool::BATCH_SIZE;
+            last->next = nullptr;
+            tokenPool().put(TokenPool::Batch{batch, TokenPool::BATCH_SIZE});
         }
+        return;
+    }
+#else
+    (void)size;
+#endif
+    ::operator delete(p);
+}
+
+std::size_t simplecpp::Token::freeTokens()
+{
+#if SIMPLECPP_TOKEN_POOL
+    return tokenPool().size() + (tokenCacheDestroyed ? 0U : tokenCache.size);
+#else
+    return 0;
+#endif
+}
+
+void simplecpp::Token::Expansion::release(const Expansion *e)
+{
+    while (e && e->refs.fetch_sub(1U, std::memory_order_acq_rel) == 1U) {
+        const Expansion * const parent = e->parent;
+        delete e;
+        e = parent;
     }
 }
 
@@ -206,12 +551,12 @@ bool simplecpp::Token::isOneOf(const char ops[]) const
 
 bool simplecpp::Token::startsWithOneOf(const char c[]) const
 {
-    return std::strchr(c, string[0]) != nullptr;
+    return std::strchr(c, str()[0]) != nullptr;
 }
 
 bool simplecpp::Token::endsWithOneOf(const char c[]) const
 {
-    return std::strchr(c, string[string.size() - 1U]) != nullptr;
+    return std::strchr(c, str()[str().size() - 1U]) != nullptr;
 }
 
 void simplecpp::Token::printAll() const
@@ -239,6 +584,8 @@ void simplecpp::Token::printOut() const
     std::cout << std::endl;
 }
 
+static const std::string COMMENT_END("*/");
+
 // cppcheck-suppress noConstructor - we call init() in the inherited to initialize the private members
 class simplecpp::TokenList::Stream {
 public:
@@ -252,25 +599,10 @@ public:
     unsigned char readChar() {
         auto ch = static_cast<unsigned char>(get());
 
-        // For UTF-16 encoded files the BOM is 0xfeff/0xfffe. If the
-        // character is non-ASCII character then replace it with 0xff
-        if (isUtf16) {
-            const auto ch2 = static_cast<unsigned char>(get());
-            const int ch16 = makeUtf16Char(ch, ch2);
-            ch = static_cast<unsigned char>(((ch16 >= 0x80) ? 0xff : ch16));
-        }
-
         // Handling of newlines..
         if (ch == '\r') {
             ch = '\n';
-
-            int ch2 = get();
-            if (isUtf16) {
-                const int c2 = get();
-                ch2 = makeUtf16Char(ch2, c2);
-            }
-
-            if (ch2 != '\n')
+            if (get() != '\n')
                 ungetChar();
         }
 
@@ -280,16 +612,6 @@ public:
     unsigned char peekChar() {
         auto ch = static_cast<unsigned char>(peek());
 
-        // For UTF-16 encoded files the BOM is 0xfeff/0xfffe. If the
-        // character is non-ASCII character then replace it with 0xff
-        if (isUtf16) {
-            (void)get();
-            const auto ch2 = static_cast<unsigned char>(peek());
-            unget();
-            const int ch16 = makeUtf16Char(ch, ch2);
-            ch = static_cast<unsigned char>(((ch16 >= 0x80) ? 0xff : ch16));
-        }
-
         // Handling of newlines..
         if (ch == '\r')
             ch = '\n';
@@ -299,8 +621,68 @@ public:
 
     void ungetChar() {
         unget();
-        if (isUtf16)
-            unget();
+    }
+
+    bool utf16() const {
+        return isUtf16;
+    }
+
+    /**
+     * Read the remaining UTF-16 input and convert it to UTF-8 in one pass so
+     * it can be lexed like any other 8-bit input. An odd trailing byte is
+     * dropped and unpaired surrogates are replaced with U+FFFD. Unhandled
+     * characters are then reported with their first UTF-8 byte, like in UTF-8
+     * input, where they used to be reported as 0xff.
+     */
+    std::vector<unsigned char> decodeUtf16() {
+        std::vector<unsigned char> ret;
+        unsigned int unit = 0;
+        bool more = readUtf16Unit(unit);
+        while (more) {
+            unsigned int cp = unit;
+            more = readUtf16Unit(unit);
+            if (cp >= 0xd800 && cp < 0xdc00 && more && unit >= 0xdc00 && unit < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (unit - 0xdc00);
+                more = readUtf16Unit(unit);
+            } else if (cp >= 0xd800 && cp < 0xe000) {
+                cp = 0xfffd;
+            }
+            appendUtf8(ret, cp);
+        }
+        return ret;
+    }
+
+    /** read the rest of a block comment, the '/' has already been read and the '*' is next */
+    template<class TextT>
+    void readBlockComment(TextT &ret) {
+        (void)readChar();
+        unsigned char ch = readChar();
+        unsigned char prev = '\0';
+        while (good()) {
+            ret += ch;
+            if (prev == '*' && ch == '/')
+                break;
+            prev = ch;
+            ch = readChar();
+        }
+    }
+
+    /** read the rest of a raw string literal up to and including the terminator */
+    void readRawString(std::string &ret, const std::string &terminator) {
+        while (good() && (!endsWith(ret, terminator) || ret.size() <= 1))
+            ret += readChar();
+    }
+
+    // Bulk helpers that are only implemented for the buffer stream, the
+    // generic stream handles these characters one at a time.
+
+    /** append characters until end, backslash or newline */
+    template<class TextT>
+    void appendPlain(TextT & /*ret*/, char /*end*/) {}
+
+    /** skip blanks other than newlines, returns the number of skipped characters */
+    std::size_t skipBlanks() {
+        return 0;
     }
 
 protected:
@@ -312,6 +694,33 @@ protected:
     }
 
 private:
+    bool readUtf16Unit(unsigned int &unit) {
+        const int ch1 = get();
+        const int ch2 = get();
+        if (ch1 == EOF || ch2 == EOF)
+            return false;
+        unit = makeUtf16Char(static_cast<unsigned char>(ch1), static_cast<unsigned char>(ch2));
+        return true;
+    }
+
+    static void appendUtf8(std::vector<unsigned char> &ret, unsigned int cp) {
+        if (cp < 0x80) {
+            ret.push_back(static_cast<unsigned char>(cp));
+        } else if (cp < 0x800) {
+            ret.push_back(static_cast<unsigned char>(0xc0 | (cp >> 6)));
+            ret.push_back(static_cast<unsigned char>(0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            ret.push_back(static_cast<unsigned char>(0xe0 | (cp >> 12)));
+            ret.push_back(static_cast<unsigned char>(0x80 | ((cp >> 6) & 0x3f)));
+            ret.push_back(static_cast<unsigned char>(0x80 | (cp & 0x3f)));
+        } else {
+            ret.push_back(static_cast<unsigned char>(0xf0 | (cp >> 18)));
+            ret.push_back(static_cast<unsigned char>(0x80 | ((cp >> 12) & 0x3f)));
+            ret.push_back(static_cast<unsigned char>(0x80 | ((cp >> 6) & 0x3f)));
+            ret.push_back(static_cast<unsigned char>(0x80 | (cp & 0x3f)));
+        }
+    }
+
     inline int makeUtf16Char(const unsigned char ch, const unsigned char ch2) const {
         return (bom == 0xfeff) ? (ch<<8 | ch2) : (ch2<<8 | ch);
     }
@@ -351,7 +760,7 @@ protected:
     bool isUtf16;
 };
 
-class StdIStream : public simplecpp::TokenList::Stream {
+class StdIStream final : public simplecpp::TokenList::Stream {
 public:
     // cppcheck-suppress uninitDerivedMemberVar - we call Stream::init() to initialize the private members
     explicit StdIStream(std::istream &istr)
@@ -377,7 +786,7 @@ private:
     std::istream &istr;
 };
 
-class StdCharBufStream : public simplecpp::TokenList::Stream {
+class StdCharBufStream final : public simplecpp::TokenList::Stream {
 public:
     // cppcheck-suppress uninitDerivedMemberVar - we call Stream::init() to initialize the private members
     StdCharBufStream(const unsigned char* str, std::size_t size)
@@ -404,91 +813,215 @@ public:
         return lastStatus != EOF;
     }
 
-private:
-    const unsigned char *str;
-    const std::size_t size;
-    std::size_t pos{};
-    int lastStatus{};
-};
+    // Non-virtual versions of the Stream helpers for the lexer. These behave
+    // like Stream::readChar() etc. UTF-16 input is transcoded by readfile()
+    // before it gets here.
+    unsigned char readChar() {
+        assert(!isUtf16);
+        if (pos >= size) {
+            lastStatus = EOF;
+            return static_cast<unsigned char>(EOF);
+        }
+        unsigned char ch = str[pos++];
 
-class FileStream : public simplecpp::TokenList::Stream {
-public:
-    /**
-     * @throws simplecpp::Output thrown if file is not found
-     */
-    // cppcheck-suppress uninitDerivedMemberVar - we call Stream::init() to initialize the private members
-    explicit FileStream(const std::string &filename, std::vector<std::string> &files)
-        : file(fopen(filename.c_str(), "rb"))
-    {
-        if (!file) {
-            files.emplace_back(filename);
-            throw simplecpp::Output(simplecpp::Output::FILE_NOT_FOUND, {}, "File is missing: " + filename);
+        // Handling of newlines..
+        if (ch == '\r') {
+            ch = '\n';
+            if (pos >= size) {
+                lastStatus = EOF;
+                --pos;
+            } else if (str[pos] == '\n')
+                ++pos;
         }
-        init();
+
+        return ch;
     }
 
-    FileStream(const FileStream&) = delete;
-    FileStream &operator=(const FileStream&) = delete;
+    unsigned char peekChar() {
+        assert(!isUtf16);
+        if (pos >= size) {
+            lastStatus = EOF;
+            return static_cast<unsigned char>(EOF);
+        }
+        const unsigned char ch = str[pos];
+        return (ch == '\r') ? '\n' : ch;
+    }
 
-    ~FileStream() override {
-        fclose(file);
-        file = nullptr;
+    void ungetChar() {
+        --pos;
     }
 
-    int get() override {
-        lastStatus = lastCh = fgetc(file);
-        return lastCh;
+    template<class TextT>
+    void readBlockComment(TextT &ret) {
+        assert(!isUtf16);
+        const unsigned char * const body = str + pos + 1U; // skip '*'
+        const unsigned char * const end = str + size;
+        const unsigned char *p = body;
+        while (p < end && (p = static_cast<const unsigned char *>(std::memchr(p, '/', end - p))) != nullptr) {
+            if (p > body && p[-1] == '*') {
+                appendNormalized(ret, body, p + 1);
+                pos = p + 1 - str;
+                return;
+            }
+            ++p;
+        }
+
+        // unterminated comment, a trailing CR is dropped like readChar() does
+        const unsigned char *last = end;
+        pos = size;
+        if (last > body && last[-1] == '\r') {
+            --last;
+            --pos;
+        }
+        appendNormalized(ret, body, last);
+        lastStatus = EOF;
     }
-    int peek() override {
-        // keep lastCh intact
-        const int ch = fgetc(file);
-        unget_internal(ch);
-        return ch;
+
+    void readRawString(std::string &ret, const std::string &terminator) {
+        assert(!isUtf16);
+        const unsigned char * const begin = str + pos;
+        const unsigned char * const end = str + size;
+        const std::size_t len = terminator.size();
+        const unsigned char *p = begin;
+        while (p < end && (p = static_cast<const unsigned char *>(std::memchr(p, terminator[0], end - p))) != nullptr) {
+            if (static_cast<std::size_t>(end - p) < len)
+                break;
+            if (std::memcmp(p, terminator.data(), len) == 0) {
+                appendNormalized(ret, begin, p + len);
+                pos = p + len - str;
+                return;
+            }
+            ++p;
+        }
+
+        // no terminator, the caller reports this
+        pos = size;
+        lastStatus = EOF;
     }
-    void unget() override {
-        unget_internal(lastCh);
+
+    template<class TextT>
+    void appendPlain(TextT &ret, char end) {
+        const unsigned char * const begin = str + pos;
+        const unsigned char *p = begin;
+        const unsigned char * const last = str + size;
+        while (p < last && *p != static_cast<unsigned char>(end) && *p != '\\' && *p != '\r' && *p != '\n')
+            ++p;
+        ret.append(reinterpret_cast<const char *>(begin), p - begin);
+        pos = p - str;
     }
-    bool good() override {
-        return lastStatus != EOF;
+
+    std::size_t skipBlanks() {
+        const std::size_t start = pos;
+        while (pos < size && str[pos] <= ' ' && str[pos] != '\n' && str[pos] != '\r')
+            ++pos;
+        return pos - start;
     }
 
 private:
-    void unget_internal(int ch) {
-        if (isUtf16) {
-            // TODO: use ungetc() as well
-            // UTF-16 has subsequent unget() calls
-            fseek(file, -1, SEEK_CUR);
-        } else
-            ungetc(ch, file);
+    /** append [begin,end) to ret, CR LF and CR are converted to LF like readChar() does */
+    template<class TextT>
+    static void appendNormalized(TextT &ret, const unsigned char *begin, const unsigned char *end) {
+        while (begin < end) {
+            const auto *cr = static_cast<const unsigned char *>(std::memchr(begin, '\r', end - begin));
+            if (!cr) {
+                ret.append(reinterpret_cast<const char *>(begin), end - begin);
+                return;
+            }
+            ret.append(reinterpret_cast<const char *>(begin), cr - begin);
+            ret += '\n';
+            begin = cr + 1;
+            if (begin < end && *begin == '\n')
+                ++begin;
+        }
     }
 
-    FILE *file;
-    int lastCh{};
+    const unsigned char *str;
+    const std::size_t size;
+    std::size_t pos{};
     int lastStatus{};
 };
 
+namespace {
+    struct FileCloser {
+        void operator()(FILE *file) const {
+            fclose(file);
+        }
+    };
+}
+
+/**
+ * Reads the whole file with as few calls as possible so the lexer can work on
+ * a contiguous buffer instead of calling fgetc() for every character.
+ * Directories give an empty buffer, and only the size of a regular file is
+ * used to size the buffer up front.
+ * @throws simplecpp::Output thrown if file is not found
+ */
+static std::vector<unsigned char> readFileBuffer(const std::string &filename, std::vector<std::string> &files)
+{
+    const std::unique_ptr<FILE, FileCloser> file(fopen(filename.c_str(), "rb"));
+    if (!file) {
+        files.emplace_back(filename);
+        throw simplecpp::Output(simplecpp::Output::FILE_NOT_FOUND, {}, "File is missing: " + filename);
+    }
+
+    std::vector<unsigned char> buf;
+
+    // larger files are read in steps so a wrong size can not drive the allocation
+    static const std::size_t maxPresize = 64U * 1024U * 1024U;
+#ifdef _WIN32
+    struct _stat64 statbuf;
+    if (_fstat64(_fileno(file.get()), &statbuf) == 0) {
+        if ((statbuf.st_mode & _S_IFMT) == _S_IFDIR)
+            return buf;
+        if ((statbuf.st_mode & _S_IFMT) == _S_IFREG && statbuf.st_size > 0)
+            buf.resize(std::min(static_cast<std::size_t>(statbuf.st_size), maxPresize));
+    }
+#else
+    struct stat statbuf;
+    if (fstat(fileno(file.get()), &statbuf) == 0) {
+        if (S_ISDIR(statbuf.st_mode))
+            return buf;
+        if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0)
+            buf.resize(std::min(static_cast<std::size_t>(statbuf.st_size), maxPresize));
+    }
+#endif
+
+    std::size_t len = fread(buf.data(), 1, buf.size(), file.get());
+    // the size is not known up front for non-regular files
+    while (len == buf.size() && !feof(file.get()) && !ferror(file.get())) {
+        buf.resize(buf.size() + std::max<std::size_t>(4096U, std::min(buf.size(), maxPresize)));
+        len += fread(buf.data() + len, 1, buf.size() - len, file.get());
+    }
+    buf.resize(len);
+
+    return buf;
+}
+
 simplecpp::TokenList::TokenList(std::vector<std::string> &filenames) : frontToken(nullptr), backToken(nullptr), files(filenames) {}
 
-simplecpp::TokenList::TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList)
+simplecpp::TokenList::TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, bool skipComments)
     : frontToken(nullptr), backToken(nullptr), files(filenames)
 {
     StdIStream stream(istr);
-    readfile(stream,filename,outputList);
+    readfile(stream,filename,outputList,skipComments);
 }
 
 simplecpp::TokenList::TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, int /*unused*/)
     : frontToken(nullptr), backToken(nullptr), files(filenames)
 {
     StdCharBufStream stream(data, size);
-    readfile(stream,filename,outputList);
+    if (stream.utf16())
+        readfile(stream,filename,outputList);
+    else
+        readStream(stream,filename,outputList,false);
 }
 
-simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList)
+simplecpp::TokenList::TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList, bool skipComments, unsigned int threads)
     : frontToken(nullptr), backToken(nullptr), files(filenames)
 {
     try {
-        FileStream stream(filename, filenames);
-        readfile(stream,filename,outputList);
+        const std::vector<unsigned char> buf = readFileBuffer(filename, filenames);
+        readBuffer(buf.data(), buf.size(), filename, outputList, skipComments, threads);
     } catch (const simplecpp::Output & e) {
         outputList->emplace_back(e);
     }
@@ -514,8 +1047,7 @@ simplecpp::TokenList &simplecpp::TokenList::operator=(const TokenList &other)
     if (this != &other) {
         clear();
         files = other.files;
-        for (const Token *tok = other.cfront(); tok; tok = tok->next)
-            push_back(new Token(*tok));
+        share(other);
         sizeOfType = other.sizeOfType;
     }
     return *this;
@@ -529,30 +1061,99 @@ simplecpp::TokenList &simplecpp::TokenList::operator=(TokenList &&other)
         other.frontToken = nullptr;
         backToken = other.backToken;
         other.backToken = nullptr;
+        shared.store(other.shared.exchange(nullptr, std::memory_order_relaxed), std::memory_order_relaxed);
         files = other.files;
         sizeOfType = std::move(other.sizeOfType);
     }
     return *this;
 }
 
-void simplecpp::TokenList::clear()
+/**
+ * The token chain of copies of a list. It is not changed while it is
+ * shared, the last list that refers to it deletes the tokens.
+ */
+struct simplecpp::TokenList::Shared {
+    explicit Shared(Token *front) : front(front), refs(1U) {}
+
+    Token * const front;
+    std::atomic<unsigned int> refs;
+};
+
+void simplecpp::TokenList::share(const TokenList &other)
 {
-    backToken = nullptr;
-    while (frontToken) {
-        Token * const next = frontToken->next;
-        delete frontToken;
-        frontToken = next;
+    if (!other.frontToken)
+        return;
+    if (other.pinned) {
+        for (const Token *tok = other.cfront(); tok; tok = tok->next)
+            push_back(new Token(*tok));
+        return;
     }
-    sizeOfType.clear();
+    // other is const and may be copied on several threads at once
+    Shared *s = other.shared.load(std::memory_order_acquire);
+    if (!s) {
+        Shared * const created = new Shared(other.frontToken);
+        if (other.shared.compare_exchange_strong(s, created, std::memory_order_acq_rel, std::memory_order_acquire))
+            s = created;
+        else
+            delete created;
+    }
+    s->refs.fetch_add(1U, std::memory_order_relaxed);
+    shared.store(s, std::memory_order_relaxed);
+    frontToken = other.frontToken;
+    backToken = other.backToken;
 }
 
-void simplecpp::TokenList::push_back(Token *tok)
+void simplecpp::TokenList::release(Shared *s)
 {
-    if (!frontToken)
-        frontToken = tok;
-    else
-        backToken->next = tok;
-    tok->previous = backToken;
+    if (s->refs.fetch_sub(1U, std::memory_order_acq_rel) != 1U)
+        return;
+    for (Token *tok = s->front; tok;) {
+        Token * const next = tok->next;
+        delete tok;
+        tok = next;
+    }
+    delete s;
+}
+
+void simplecpp::TokenList::copyShared()
+{
+    Shared * const s = shared.exchange(nullptr, std::memory_order_acquire);
+    if (s->refs.load(std::memory_order_acquire) == 1U) {
+        // the other copies are gone, the tokens are ours again
+        delete s;
+        return;
+    }
+    const Token *tok = frontToken;
+    frontToken = backToken = nullptr;
+    for (; tok; tok = tok->next)
+        push_back(new Token(*tok));
+    release(s);
+}
+
+void simplecpp::TokenList::clear()
+{
+    Shared * const s = shared.exchange(nullptr, std::memory_order_relaxed);
+    if (s) {
+        frontToken = backToken = nullptr;
+        release(s);
+    }
+    backToken = nullptr;
+    while (frontToken) {
+        Token * const next = frontToken->next;
+        delete frontToken;
+        frontToken = next;
+    }
+    sizeOfType.clear();
+}
+
+void simplecpp::TokenList::push_back(Token *tok)
+{
+    unshare();
+    if (!frontToken)
+        frontToken = tok;
+    else
+        backToken->next = tok;
+    tok->previous = backToken;
     backToken = tok;
 }
 
@@ -628,12 +1229,153 @@ static void portabilityBackslash(simplecpp::OutputList *outputList, const simple
     outputList->emplace_back(std::move(err));
 }
 
+/** same classification as Token::comment */
+static bool isCommentToken(const std::string &str)
+{
+    return str.size() > 1U && str[0] == '/' && (str[1] == '/' || str[1] == '*');
+}
+
+namespace {
+    /**
+     * Takes the place of the text of a comment that the lexer skips. Only
+     * what the lexer needs to know about the text is kept, the comment is
+     * not copied.
+     */
+    class SkippedCommentText {
+    public:
+        SkippedCommentText &operator+=(char ch) {
+            append(&ch, 1U);
+            return *this;
+        }
+
+        SkippedCommentText &operator+=(const std::string &str) {
+            append(str.data(), str.size());
+            return *this;
+        }
+
+        void append(const char *str, std::size_t len) {
+            if (len == 0)
+                return;
+            const char * const end = str + len;
+            const char *p = str;
+            const char *nl;
+            while ((nl = static_cast<const char *>(std::memchr(p, '\n', end - p))) != nullptr) {
+                ++mNewlines;
+                if ((nl > str ? nl[-1] : mLast) == '\\')
+                    ++mSplices;
+                mLineSize = 0;
+                p = nl + 1;
+            }
+            mLineSize += end - p;
+            mPrevLast = (len > 1U) ? end[-2] : mLast;
+            mLast = end[-1];
+            mSize += len;
+        }
+
+        /** length of the text */
+        std::size_t size() const {
+            return mSize;
+        }
+        /** number of newlines */
+        unsigned int newlines() const {
+            return mNewlines;
+        }
+        /** number of backslash newlines */
+        unsigned int splices() const {
+            return mSplices;
+        }
+        /** length of the text after the last newline */
+        std::size_t lastLineSize() const {
+            return mLineSize;
+        }
+        bool endsWithCommentEnd() const {
+            return mSize >= 4U && mPrevLast == '*' && mLast == '/';
+        }
+
+    private:
+        std::size_t mSize{};
+        std::size_t mLineSize{};
+        unsigned int mNewlines{};
+        unsigned int mSplices{};
+        char mLast{};
+        char mPrevLast{};
+    };
+}
+
+/** read the rest of a line comment, ch is its first character */
+template<class StreamT, class TextT>
+static void readLineComment(StreamT &stream, TextT &text, unsigned char ch, unsigned int &multiline, const simplecpp::Location &location, simplecpp::OutputList *outputList)
+{
+    while (stream.good() && ch != '\n') {
+        text += static_cast<char>(ch);
+        stream.appendPlain(text, '\n');
+        ch = stream.readChar();
+        if (ch == '\\') {
+            std::string tmp;
+            char tmp_ch = ch;
+            while ((stream.good()) && (tmp_ch == '\\' || tmp_ch == ' ' || tmp_ch == '\t')) {
+                tmp += tmp_ch;
+                tmp_ch = stream.readChar();
+            }
+            if (!stream.good()) {
+                break;
+            }
+
+            if (tmp_ch != '\n') {
+                text += tmp;
+            } else {
+                // tmp starts with a backslash, is there a blank after the last one
+                const std::string::size_type pos = tmp.find_last_not_of(" \t");
+                if (pos < tmp.size() - 1U && tmp[pos] == '\\')
+                    portabilityBackslash(outputList, location);
+                ++multiline;
+                tmp_ch = stream.readChar();
+                text += '\n';
+            }
+            ch = tmp_ch;
+        }
+    }
+    if (ch == '\n') {
+        stream.ungetChar();
+    }
+}
+
 static bool isStringLiteralPrefix(const std::string &str)
 {
     return str == "u" || str == "U" || str == "L" || str == "u8" ||
            str == "R" || str == "uR" || str == "UR" || str == "LR" || str == "u8R";
 }
 
+/**
+ * Is "c1c2" an operator that TokenList::combineOperators() combines whatever
+ * the tokens around it are. "&=", "++", "--" and the operators with '.' depend
+ * on the context and are left to combineOperators().
+ */
+static bool isCombinedOperator(unsigned char c1, unsigned char c2)
+{
+    switch (c1) {
+    case '=':
+    case '!':
+    case '+':
+    case '*':
+    case '/':
+    case '%':
+    case '^':
+        return c2 == '=';
+    case '-':
+        return c2 == '=' || c2 == '>';
+    case '<':
+    case '>':
+    case '|':
+        return c2 == '=' || c2 == c1;
+    case '&':
+    case ':':
+        return c2 == c1;
+    default:
+        return false;
+    }
+}
+
 void simplecpp::TokenList::lineDirective(unsigned int fileIndex, unsigned int line, Location &location)
 {
     if (fileIndex != location.fileIndex || line >= location.line) {
@@ -651,18 +1393,232 @@ void simplecpp::TokenList::lineDirective(unsigned int fileIndex, unsigned int li
     }
 }
 
-static const std::string COMMENT_END("*/");
-
-void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename, OutputList *outputList)
+void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename, OutputList *outputList, bool skipComments)
 {
-    std::stack<simplecpp::Location> loc;
+    unshare();
+    if (stream.utf16()) {
+        const std::vector<unsigned char> buf = stream.decodeUtf16();
+        StdCharBufStream utf8(buf.data(), buf.size());
+        readStream(utf8, filename, outputList, skipComments);
+        return;
+    }
+    readStream(stream, filename, outputList, skipComments);
+}
 
-    unsigned int multiline = 0U;
+namespace {
+    /**
+     * Hashed lookup of the names in a files vector. While a file is lexed
+     * names are only appended to the vector, so the index only needs to
+     * pick up the names that were appended since the last lookup.
+     */
+    class FileIndex {
+    public:
+        /** get the index of a file name, it is appended if it is not known yet */
+        unsigned int get(std::vector<std::string> &files, const std::string &filename) {
+            const std::hash<std::string> hasher;
+            if (mIndexed > files.size()) {
+                mIndex.clear();
+                mIndexed = 0;
+            }
+            for (; mIndexed < files.size(); ++mIndexed)
+                mIndex.emplace(hasher(files[mIndexed]), mIndexed);
+            const std::size_t hash = hasher(filename);
+            const auto range = mIndex.equal_range(hash);
+            unsigned int first = mIndexed;
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second < first && files[it->second] == filename)
+                    first = it->second;
+            }
+            if (first < mIndexed)
+                return first;
+            files.push_back(filename);
+            mIndex.emplace(hash, mIndexed);
+            return mIndexed++;
+        }
+
+    private:
+        unsigned int mIndexed{};
+        std::unordered_multimap<std::size_t, unsigned int> mIndex;
+    };
+}
+
+/** lexer state, this is kept between the readStream() calls when a file is lexed in chunks */
+struct simplecpp::TokenList::LexState {
+    LexState(const Location &location, bool skipComments, const Token *lineStart)
+        : location(location), skipComments(skipComments), lineStart(lineStart), executableScope(1U, false) {}
+
+    Location location;
+    bool skipComments;
+    std::stack<Location> loc;
+    unsigned int multiline{};
+    const Token *oldLastToken{};
+    /** the file names of #line directives are looked up in this index */
+    FileIndex fileNames;
+
+    // When comments are skipped no token is created for a comment. The token
+    // before it gets Token::mCommentAhead instead, so the checks below and
+    // combineOperators() do not look past the comment. The location of the
+    // last comment after the tokens that can become the last token again
+    // is kept here, nullptr stands for the comments before the first token.
+    std::vector<std::pair<const Token *, Location>> skippedComments;
+    bool frontCommentAhead{};
+    unsigned int skippedCount{};
+    unsigned int oldSkippedCount{};
+
+    // First token on the last line that is not a comment, this is what
+    // lastLineTok() returns. It is updated as tokens and comments are added
+    // and removed so the directive checks do not need to scan the line.
+    const Token *lineStart;
+    const Token *prevLineStart{};
+    bool prevLineStartKnown{};
+
+    // The operators are combined while lexing once the tokens around them
+    // can no longer change. Only a line that starts with '#' or '\\' can be
+    // deleted completely, the tokens before any other line are final.
+    std::vector<bool> executableScope;
+    Token *combineTok{}; // next token to combine, nullptr for front()
+    const Token *finalTok{};
+
+    /** readStream() returns once this many more lines are final, 0 to read the whole stream */
+    unsigned int pauseLines{};
+    /** the stream could not be lexed, the token list has been cleared */
+    bool failed{};
+    /** the lexer stopped at a syntax error, the rest of the stream has not been lexed */
+    bool stopped{};
+    /** the stream ended inside a block comment */
+    bool openComment{};
+    /** combine the operators while lexing, otherwise the caller combines them once the file is lexed */
+    bool combine{true};
+    /** the file goes on after the stream, the tokens from combineTok on are combined by the caller */
+    bool continued{};
+};
+
+template<class StreamT>
+void simplecpp::TokenList::readStream(StreamT &stream, const std::string &filename, OutputList *outputList, bool skipComments)
+{
+    LexState state(Location(fileIndex(filename), 1, 1), skipComments, lastLineTok());
+    readStream(stream, state, outputList);
+}
 
-    const Token *oldLastToken = nullptr;
+template<class StreamT>
+bool simplecpp::TokenList::readStream(StreamT &stream, LexState &state, OutputList *outputList)
+{
+    std::stack<simplecpp::Location> &loc = state.loc;
+    unsigned int &multiline = state.multiline;
+    const Token *&oldLastToken = state.oldLastToken;
+    std::vector<std::pair<const Token *, Location>> &skippedComments = state.skippedComments;
+    const Token *&lineStart = state.lineStart;
+    const Token *&prevLineStart = state.prevLineStart;
+    bool &prevLineStartKnown = state.prevLineStartKnown;
+    std::vector<bool> &executableScope = state.executableScope;
+    Token *&combineTok = state.combineTok;
+    const Token *&finalTok = state.finalTok;
+    bool paused = false;
+    const auto combineFinal = [&]() {
+        finalTok = cback();
+        // a new token can be allocated at the address of a combined token
+        oldLastToken = nullptr;
+        Token *tok = combineTok ? combineTok : front();
+        for (;;) {
+            // combineOperators() looks at the next 5 tokens
+            const Token *lookahead = tok;
+            for (int i = 0; i < 6; ++i) {
+                if (lookahead == finalTok) {
+                    combineTok = tok;
+                    return;
+                }
+                lookahead = lookahead->next;
+            }
+            combineOperators(tok, executableScope, state.frontCommentAhead);
+            tok = tok->next;
+        }
+    };
+    const auto commentAhead = [&](const Token *tok) {
+        return tok ? tok->mCommentAhead : state.frontCommentAhead;
+    };
+    // the skipped comment after the last token, if there is one
+    const auto lastComment = [&]() -> Location * {
+        const Token * const last = cback();
+        if (commentAhead(last)) {
+            for (auto it = skippedComments.rbegin(); it != skippedComments.rend(); ++it) {
+                if (it->first == last)
+                    return &it->second;
+            }
+        }
+        return nullptr;
+    };
+    // location of the last token or skipped comment
+    const auto lastLocation = [&]() -> const Location * {
+        const Location * const comment = lastComment();
+        return comment ? comment : (cback() ? &cback()->location : nullptr);
+    };
+    const auto startLine = [&](const Location &newLocation) {
+        const Location * const last = lastLocation();
+        if (!last || !last->sameline(newLocation)) {
+            prevLineStart = lineStart;
+            prevLineStartKnown = true;
+            lineStart = nullptr;
+            // only the last token before this line can become the last token again
+            Location * const comment = lastComment();
+            if (comment) {
+                const std::pair<const Token *, Location> kept(cback(), *comment);
+                skippedComments.assign(1U, kept);
+            } else {
+                skippedComments.clear();
+            }
+            return true;
+        }
+        return false;
+    };
+    const auto newLine = [&](const Location &newLocation, char op) {
+        if (startLine(newLocation) && cback() && op != '#' && op != '\\') {
+            if (state.combine)
+                combineFinal();
+            if (state.pauseLines && --state.pauseLines == 0)
+                paused = true;
+        }
+    };
+    const auto pushToken = [&](Token *tok) {
+        newLine(tok->location, tok->op);
+        push_back(tok);
+        if (!lineStart && !tok->comment)
+            lineStart = tok;
+    };
+    const auto skipComment = [&](const Location &commentLocation) {
+        newLine(commentLocation, '\0');
+        ++state.skippedCount;
+        Location * const comment = lastComment();
+        if (comment) {
+            *comment = commentLocation;
+            return;
+        }
+        if (cback())
+            back()->mCommentAhead = true;
+        else
+            state.frontCommentAhead = true;
+        skippedComments.emplace_back(cback(), commentLocation);
+    };
+    const auto pushComment = [&](const TokenString &comment, const Location &commentLocation, bool wsahead) {
+        if (state.skipComments)
+            skipComment(commentLocation);
+        else
+            pushToken(new Token(comment, commentLocation, wsahead));
+    };
+    // the tokens at the back that were on the line at deletedLocation have been deleted
+    const auto backDeleted = [&](const Location &deletedLocation) {
+        const Location * const last = lastLocation();
+        const bool lineDeleted = !last || !last->sameline(deletedLocation);
+        if (lineDeleted && prevLineStartKnown)
+            lineStart = prevLineStart;
+        else if (last && cback() && !last->sameline(cback()->location))
+            lineStart = nullptr; // the last line only has comments
+        else
+            lineStart = lastLineTok();
+        prevLineStartKnown = false;
+    };
 
-    Location location(fileIndex(filename), 1, 1);
-    while (stream.good()) {
+    Location &location = state.location;
+    while (!paused && stream.good()) {
         unsigned char ch = stream.readChar();
         if (!stream.good())
             break;
@@ -677,15 +1633,26 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                 outputList->emplace_back(std::move(err));
             }
             clear();
-            return;
+            state.failed = true;
+            return false;
         }
 
         if (ch == '\n') {
-            if (cback() && cback()->op == '\\') {
+            if (cback() && cback()->op == '\\' && !cback()->mCommentAhead) {
                 if (location.col > cback()->location.col + 1U)
                     portabilityBackslash(outputList, cback()->location);
                 ++multiline;
+                const Location backslashLocation = cback()->location;
+                const bool backslashLineStart = (lineStart == cback());
                 deleteToken(back());
+                // the other tokens on the line are still there
+                const Location * const last = lastLocation();
+                if (last && last->sameline(backslashLocation)) {
+                    if (backslashLineStart)
+                        lineStart = nullptr;
+                } else {
+                    backDeleted(backslashLocation);
+                }
             } else {
                 location.line += multiline + 1;
                 multiline = 0U;
@@ -693,18 +1660,21 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
             if (!multiline)
                 location.col = 1;
 
-            if (oldLastToken != cback()) {
+            if (oldLastToken != cback() || state.oldSkippedCount != state.skippedCount) {
                 oldLastToken = cback();
-                const Token * const llTok = isLastLinePreprocessor();
-                if (!llTok)
+                state.oldSkippedCount = state.skippedCount;
+                const Token * const llTok = lineStart;
+                if (!llTok || llTok->op != '#')
                     continue;
-                const Token * const llNextToken = llTok->next;
-                if (!llTok->next)
+                const Location directiveLocation = llTok->location;
+                const Token * const llNextToken = llTok->nextSkipComments();
+                if (!llNextToken)
                     continue;
-                if (llNextToken->next) {
+                const Token * const operandTok = llNextToken->nextSkipComments();
+                if (operandTok) {
                     // #file "file.c"
                     if (llNextToken->str() == "file" &&
-                        llNextToken->next->str()[0] == '\"')
+                        operandTok->str()[0] == '\"')
                     {
                         const Token *strtok = cback();
                         while (strtok->comment)
@@ -717,11 +1687,11 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                     // #3 "file.c"
                     // #line 3 "file.c"
                     else if ((llNextToken->number &&
-                              llNextToken->next->str()[0] == '\"') ||
+                              operandTok->str()[0] == '\"') ||
                              (llNextToken->str() == "line" &&
-                              llNextToken->next->number &&
-                              llNextToken->next->next &&
-                              llNextToken->next->next->str()[0] == '\"'))
+                              operandTok->number &&
+                              operandTok->nextSkipComments() &&
+                              operandTok->nextSkipComments()->str()[0] == '\"'))
                     {
                         const Token *strtok = cback();
                         while (strtok->comment)
@@ -729,18 +1699,24 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                         const Token *numtok = strtok->previous;
                         while (numtok->comment)
                             numtok = numtok->previous;
-                        lineDirective(fileIndex(replaceAll(strtok->str().substr(1U, strtok->str().size() - 2U),"\\\\","\\")),
+                        lineDirective(state.fileNames.get(files, replaceAll(strtok->str().substr(1U, strtok->str().size() - 2U),"\\\\","\\")),
                                       std::atol(numtok->str().c_str()), location);
                     }
                     // #line 3
                     else if (llNextToken->str() == "line" &&
-                             llNextToken->next->number)
+                             operandTok->number)
                     {
                         const Token *numtok = cback();
                         while (numtok->comment)
                             numtok = numtok->previous;
                         lineDirective(location.fileIndex, std::atol(numtok->str().c_str()), location);
                     }
+                    // the directive might have been removed, a new token
+                    // can then be allocated at the address of oldLastToken
+                    if (oldLastToken != cback()) {
+                        oldLastToken = nullptr;
+                        backDeleted(directiveLocation);
+                    }
                 }
                 // #endfile
                 else if (llNextToken->str() == "endfile" && !loc.empty())
@@ -754,15 +1730,16 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
         }
 
         if (ch <= ' ') {
-            location.col++;
+            location.col += 1U + stream.skipBlanks();
             continue;
         }
 
         TokenString currentToken;
 
-        if (cback() && cback()->location.line == location.line && cback()->previous && cback()->previous->op == '#') {
+        if (cback() && cback()->location.line == location.line && cback()->previous && cback()->previous->op == '#' &&
+            !cback()->mCommentAhead && !cback()->previous->mCommentAhead) {
             const Token* const ppTok = cback()->previous;
-            if (ppTok->next && (ppTok->next->str() == "error" || ppTok->next->str() == "warning")) {
+            if (ppTok->next && (ppTok->next->keyword() == KwError || ppTok->next->keyword() == KwWarning)) {
                 char prev = ' ';
                 while (stream.good() && (prev == '\\' || (ch != '\r' && ch != '\n'))) {
                     currentToken += ch;
@@ -770,7 +1747,10 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                     ch = stream.readChar();
                 }
                 stream.ungetChar();
-                push_back(new Token(currentToken, location));
+                if (isCommentToken(currentToken))
+                    pushComment(currentToken, location, false);
+                else
+                    pushToken(new Token(currentToken, location));
                 location.adjust(currentToken);
                 continue;
             }
@@ -791,50 +1771,45 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
 
         // comment
         else if (ch == '/' && stream.peekChar() == '/') {
-            while (stream.good() && ch != '\n') {
-                currentToken += ch;
-                ch = stream.readChar();
-                if (ch == '\\') {
-                    TokenString tmp;
-                    char tmp_ch = ch;
-                    while ((stream.good()) && (tmp_ch == '\\' || tmp_ch == ' ' || tmp_ch == '\t')) {
-                        tmp += tmp_ch;
-                        tmp_ch = stream.readChar();
-                    }
-                    if (!stream.good()) {
-                        break;
-                    }
-
-                    if (tmp_ch != '\n') {
-                        currentToken += tmp;
-                    } else {
-                        const TokenString check_portability = currentToken + tmp;
-                        const std::string::size_type pos = check_portability.find_last_not_of(" \t");
-                        if (pos < check_portability.size() - 1U && check_portability[pos] == '\\')
-                            portabilityBackslash(outputList, location);
-                        ++multiline;
-                        tmp_ch = stream.readChar();
-                        currentToken += '\n';
-                    }
-                    ch = tmp_ch;
-                }
-            }
-            if (ch == '\n') {
-                stream.ungetChar();
+            if (state.skipComments) {
+                SkippedCommentText text;
+                readLineComment(stream, text, ch, multiline, location, outputList);
+                skipComment(location);
+                // a line comment only contains the newlines of line splices
+                location.col += text.size();
+                continue;
             }
+            readLineComment(stream, currentToken, ch, multiline, location, outputList);
         }
 
         // comment
         else if (ch == '/' && stream.peekChar() == '*') {
-            currentToken = "/*";
-            (void)stream.readChar();
-            ch = stream.readChar();
-            while (stream.good()) {
-                currentToken += ch;
-                if (currentToken.size() >= 4U && endsWith(currentToken, COMMENT_END))
-                    break;
-                ch = stream.readChar();
+            if (state.skipComments) {
+                SkippedCommentText text;
+                text += std::string("/*");
+                stream.readBlockComment(text);
+                if (!text.endsWithCommentEnd())
+                    state.openComment = true;
+                // the same as the erasing of newlines below
+                multiline += text.splices();
+                const bool joined = multiline || (lineStart && lineStart->op == '#');
+                if (joined)
+                    multiline += text.newlines() - text.splices();
+                skipComment(location);
+                if (joined)
+                    location.col += text.size() - text.newlines() - text.splices();
+                else if (text.newlines() == 0)
+                    location.col += text.size();
+                else {
+                    location.line += text.newlines();
+                    location.col = 1U + text.lastLineSize();
+                }
+                continue;
             }
+            currentToken = "/*";
+            stream.readBlockComment(currentToken);
+            if (currentToken.size() < 4U || !endsWith(currentToken, COMMENT_END))
+                state.openComment = true;
             // multiline..
 
             std::string::size_type pos = 0;
@@ -842,7 +1817,7 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                 currentToken.erase(pos,2);
                 ++multiline;
             }
-            if (multiline || isLastLinePreprocessor()) {
+            if (multiline || (lineStart && lineStart->op == '#')) {
                 pos = 0;
                 while ((pos = currentToken.find('\n',pos)) != std::string::npos) {
                     currentToken.erase(pos,1);
@@ -854,7 +1829,7 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
         // string / char literal
         else if (ch == '\"' || ch == '\'') {
             std::string prefix;
-            if (cback() && cback()->name && isStringLiteralPrefix(cback()->str()) &&
+            if (cback() && cback()->name && !cback()->mCommentAhead && isStringLiteralPrefix(cback()->str()) &&
                 ((cback()->location.col + cback()->str().size()) == location.col) &&
                 (cback()->location.line == location.line)) {
                 prefix = cback()->str();
@@ -878,11 +1853,11 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                         };
                         outputList->emplace_back(std::move(err));
                     }
-                    return;
+                    state.stopped = true;
+                    break;
                 }
                 const std::string endOfRawString(')' + delim + currentToken);
-                while (stream.good() && (!endsWith(currentToken, endOfRawString) || currentToken.size() <= 1))
-                    currentToken += stream.readChar();
+                stream.readRawString(currentToken, endOfRawString);
                 if (!endsWith(currentToken, endOfRawString)) {
                     if (outputList) {
                         Output err{
@@ -892,7 +1867,8 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                         };
                         outputList->emplace_back(std::move(err));
                     }
-                    return;
+                    state.stopped = true;
+                    break;
                 }
                 currentToken.erase(currentToken.size() - endOfRawString.size(), endOfRawString.size() - 1U);
                 currentToken = escapeString(currentToken);
@@ -908,9 +1884,11 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
             }
 
             currentToken = readUntil(stream,location,ch,ch,outputList);
-            if (currentToken.size() < 2U)
+            if (currentToken.size() < 2U) {
                 // Error is reported by readUntil()
-                return;
+                state.failed = true;
+                return false;
+            }
 
             std::string s = currentToken;
             std::string::size_type pos;
@@ -920,14 +1898,15 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
                 newlines++;
             }
 
-            if (prefix.empty())
-                push_back(new Token(s, location, !!std::isspace(stream.peekChar()))); // push string without newlines
-            else
+            if (prefix.empty()) {
+                pushToken(new Token(s, location, !!std::isspace(stream.peekChar()))); // push string without newlines
+            } else {
                 back()->setstr(prefix + s);
+            }
 
             if (newlines > 0) {
-                const Token * const llTok = lastLineTok();
-                if (llTok && llTok->op == '#' && llTok->next && (llTok->next->str() == "define" || llTok->next->str() == "pragma") && llTok->next->next) {
+                const Token * const llTok = lineStart;
+                if (llTok && llTok->op == '#' && llTok->next && (llTok->next->keyword() == KwDefine || llTok->next->keyword() == KwPragma) && llTok->next->next) {
                     multiline += newlines;
                     location.adjust(s);
                     continue;
@@ -943,27 +1922,468 @@ void simplecpp::TokenList::readfile(Stream &stream, const std::string &filename,
         }
 
         if (*currentToken.begin() == '<') {
-            const Token * const llTok = lastLineTok();
-            if (llTok && llTok->op == '#' && llTok->next && llTok->next->str() == "include") {
+            const Token * const llTok = lineStart;
+            if (llTok && llTok->op == '#' && llTok->next && llTok->next->keyword() == KwInclude) {
                 currentToken = readUntil(stream, location, '<', '>', outputList);
-                if (currentToken.size() < 2U)
-                    return;
+                if (currentToken.size() < 2U) {
+                    state.failed = true;
+                    return false;
+                }
             }
         }
 
-        push_back(new Token(currentToken, location, !!std::isspace(stream.peekChar())));
+        bool whitespaceahead;
+        // two character operator, unless combineOperators() might combine
+        // the first character with an operator right before it
+        if (currentToken.size() == 1U && isCombinedOperator(currentToken[0], stream.peekChar()) &&
+            !(cback() && cback()->op != '\0' && !cback()->mCommentAhead && cback()->location.sameline(location) && cback()->location.col + 1U == location.col)) {
+            currentToken += stream.readChar();
+            whitespaceahead = false; // like the first character of a combined operator
+        } else {
+            whitespaceahead = !!std::isspace(stream.peekChar());
+        }
 
-        if (multiline)
+        if (isCommentToken(currentToken))
+            pushComment(currentToken, location, whitespaceahead);
+        else
+            pushToken(new Token(currentToken, location, whitespaceahead));
+
+        // only comments and header names can span lines here
+        if (multiline || (currentToken[0] != '/' && currentToken[0] != '<'))
             location.col += currentToken.size();
         else
             location.adjust(currentToken);
     }
 
-    combineOperators();
+    if (paused)
+        return true;
+
+    if (state.combine && !state.continued) {
+        for (Token *tok = combineTok ? combineTok : front(); tok; tok = tok->next)
+            combineOperators(tok, executableScope, state.frontCommentAhead);
+    }
+    return false;
+}
+
+namespace {
+    /** a position in a file buffer where lexing can start afresh */
+    struct LexSplit {
+        std::size_t pos;
+        unsigned int line;
+    };
+}
+
+static bool isRawStringPrefix(const unsigned char *data, std::size_t start, std::size_t end)
+{
+    const std::string prefix(reinterpret_cast<const char *>(data + start), end - start);
+    return prefix == "R" || prefix == "uR" || prefix == "UR" || prefix == "LR" || prefix == "u8R";
+}
+
+/**
+ * Find line starts in the buffer about chunkSize bytes apart where the lexer
+ * can start with a fresh state. A cheap scan skips the lines that continue a
+ * block comment, a raw string or a backslash continuation. It does not need
+ * to be exact, the caller checks that the lexer ended each part cleanly.
+ */
+static std::vector<LexSplit> findLexSplits(const unsigned char *data, std::size_t size, std::size_t chunkSize)
+{
+    std::vector<LexSplit> splits(1U, LexSplit{0U, 1U});
+    std::size_t target = chunkSize;
+    unsigned int line = 1U;
+    std::size_t wordStart = 0U;
+    std::string rawEnd;
+    bool blockComment = false;
+    bool lineComment = false;
+    unsigned char quote = 0;
+    // the last character on the line that is not blank
+    unsigned char last = '\n';
+    // the lexer looks at the line before a block comment if it is a directive
+    bool directive = false;
+    for (std::size_t pos = 0U; pos < size; ++pos) {
+        const unsigned char ch = data[pos];
+        const bool newline = (ch == '\n' || (ch == '\r' && (pos + 1U == size || data[pos + 1U] != '\n')));
+        if (newline)
+            ++line;
+        if (!rawEnd.empty()) {
+            if (ch == ')' && size - pos >= rawEnd.size() && std::equal(rawEnd.cbegin(), rawEnd.cend(), data + pos)) {
+                pos += rawEnd.size() - 1U;
+                rawEnd.clear();
+                last = '\"';
+            }
+            continue;
+        }
+        if (blockComment) {
+            if (ch == '*' && pos + 1U < size && data[pos + 1U] == '/') {
+                ++pos;
+                blockComment = false;
+                last = '/';
+            }
+            continue;
+        }
+        if (ch == '\r' && !newline)
+            continue;
+        if (newline) {
+            if (last == '\\')
+                continue;
+            last = '\n';
+            quote = 0;
+            lineComment = false;
+            const bool afterDirective = directive;
+            directive = false;
+            // a chunk must not start with what the lexer might take for a BOM
+            if (ch == '\n' && !afterDirective && pos + 1U >= target && pos + 1U < size && data[pos + 1U] < 0x80) {
+                splits.push_back(LexSplit{pos + 1U, line});
+                target = pos + 1U + chunkSize;
+            }
+            continue;
+        }
+        if (ch > ' ')
+            last = ch;
+        if (lineComment)
+            continue;
+        if (quote) {
+            if (ch == '\\' && pos + 1U < size && data[pos + 1U] != '\n' && data[pos + 1U] != '\r') {
+                ++pos;
+                if (data[pos] > ' ')
+                    last = data[pos];
+            } else if (ch == quote) {
+                quote = 0;
+            }
+            continue;
+        }
+        if (ch == '/' && pos + 1U < size && (data[pos + 1U] == '*' || data[pos + 1U] == '/')) {
+            blockComment = (data[pos + 1U] == '*');
+            lineComment = !blockComment;
+            ++pos;
+            continue;
+        }
+        const bool afterName = (pos > 0U && isNameChar(data[pos - 1U]));
+        if (ch == '#') {
+            directive = true;
+        } else if (isNameChar(ch)) {
+            if (!afterName)
+                wordStart = pos;
+        } else if (ch == '\"' || ch == '\'') {
+            // digit separator
+            if (ch == '\'' && afterName && std::isdigit(data[wordStart]) && pos + 1U < size && isNameChar(data[pos + 1U]))
+                continue;
+            if (ch == '\"' && afterName && isRawStringPrefix(data, wordStart, pos)) {
+                std::size_t paren = pos + 1U;
+                while (paren < size && data[paren] != '(' && data[paren] != '\n' && data[paren] != '\r')
+                    ++paren;
+                if (paren < size && data[paren] == '(') {
+                    rawEnd = ')' + std::string(reinterpret_cast<const char *>(data + pos + 1U), paren - pos - 1U) + '\"';
+                    pos = paren;
+                    continue;
+                }
+            }
+            quote = ch;
+        }
+    }
+    return splits;
+}
+
+// smallest part of a file that is lexed on its own thread
+static const std::size_t PARALLEL_LEX_MIN_CHUNK = 256U * 1024U;
+
+void simplecpp::TokenList::readBuffer(const unsigned char *data, std::size_t size, const std::string &filename, OutputList *outputList, bool skipComments, unsigned int threads)
+{
+    StdCharBufStream stream(data, size);
+    if (stream.utf16()) {
+        const std::vector<unsigned char> buf = stream.decodeUtf16();
+        readBuffer(buf.data(), buf.size(), filename, outputList, skipComments, threads);
+        return;
+    }
+
+    std::vector<LexSplit> splits;
+    if (threads > 1U && size >= 2U * PARALLEL_LEX_MIN_CHUNK)
+        splits = findLexSplits(data, size, std::max(size / threads + 1U, PARALLEL_LEX_MIN_CHUNK));
+    if (splits.size() <= 1U) {
+        readStream(stream, filename, outputList, skipComments);
+        return;
+    }
+
+    // The chunks are lexed into their own lists, with their own copy of the
+    // filenames since a #line directive can add one. combineOperators() can
+    // look at the lines before and after a token, so only the first chunk
+    // combines operators while it is lexed. The rest are combined once the
+    // chunks are joined.
+    struct Chunk {
+        Chunk(const std::vector<std::string> &filenames, const Location &location, bool skipComments, bool first)
+            : files(filenames), list(files), state(location, skipComments, nullptr) {
+            state.combine = first;
+            state.continued = first;
+        }
+        std::vector<std::string> files;
+        TokenList list;
+        LexState state;
+        OutputList outputList;
+    };
+    const unsigned int fileIdx = fileIndex(filename);
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    for (const LexSplit &split : splits)
+        chunks.emplace_back(new Chunk(files, Location(fileIdx, split.line, 1), skipComments, chunks.empty()));
+    // What a chunk throws is kept until all the threads are joined and then
+    // rethrown. The chunks that no thread could be started for are lexed on
+    // this thread.
+    std::vector<std::exception_ptr> errors(chunks.size());
+    const auto lexChunk = [&](std::size_t i) {
+        try {
+            const std::size_t end = (i + 1U < splits.size()) ? splits[i + 1U].pos : size;
+            StdCharBufStream chunkStream(data + splits[i].pos, end - splits[i].pos);
+            Chunk &chunk = *chunks[i];
+            chunk.list.readStream(chunkStream, chunk.state, &chunk.outputList);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    {
+        struct JoinGuard {
+            ~JoinGuard() {
+                for (std::thread &worker : workers)
+                    worker.join();
+            }
+            std::vector<std::thread> workers;
+        } guard;
+        guard.workers.reserve(chunks.size() - 1U);
+        std::size_t started = 1U;
+        try {
+            for (; started < chunks.size(); ++started)
+                guard.workers.emplace_back(lexChunk, started);
+        } catch (const std::system_error &) {
+        }
+        for (std::size_t i = started; i < chunks.size(); ++i)
+            lexChunk(i);
+        lexChunk(0U);
+    }
+    for (const std::exception_ptr &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // A chunk that did not end where the next one starts, because of a
+    // directive or an unexpected split, and the chunks after it are lexed
+    // again in one go.
+    std::size_t good = 0U;
+    while (good + 1U < chunks.size()) {
+        const LexState &state = chunks[good]->state;
+        if (state.failed || state.stopped || state.openComment || state.multiline != 0U || !state.loc.empty() ||
+            (state.lineStart && state.lineStart->op == '#') ||
+            state.location.fileIndex != fileIdx || state.location.line != splits[good + 1U].line ||
+            chunks[good]->files.size() != files.size())
+            break;
+        ++good;
+    }
+    if (good + 1U < chunks.size()) {
+        chunks.resize(good + 1U);
+        chunks[good].reset(new Chunk(files, Location(fileIdx, splits[good].line, 1), skipComments, false));
+        StdCharBufStream restStream(data + splits[good].pos, size - splits[good].pos);
+        chunks[good]->list.readStream(restStream, chunks[good]->state, &chunks[good]->outputList);
+    }
+
+    std::vector<bool> executableScope(1U, false);
+    Token *combineTok = nullptr;
+    if (chunks[0]->state.combine) {
+        executableScope = chunks[0]->state.executableScope;
+        combineTok = chunks[0]->state.combineTok;
+    }
+    bool frontCommentAhead = false;
+    for (const std::unique_ptr<Chunk> &chunk : chunks) {
+        // a comment at the start of the chunk follows the last token so far
+        if (chunk->state.frontCommentAhead) {
+            if (back())
+                back()->mCommentAhead = true;
+            else
+                frontCommentAhead = true;
+        }
+        takeTokens(chunk->list);
+        if (outputList)
+            outputList->splice(outputList->end(), chunk->outputList);
+    }
+    files = chunks.back()->files;
+    if (chunks.back()->state.failed) {
+        clear();
+        return;
+    }
+
+    for (Token *tok = combineTok ? combineTok : front(); tok; tok = tok->next)
+        combineOperators(tok, executableScope, frontCommentAhead);
+}
+
+// number of lines a TokenStream lexes at a time
+static const unsigned int STREAM_CHUNK_LINES = 256U;
+
+simplecpp::TokenStream::TokenStream(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList, bool skipComments)
+    : list(filenames), outputList(outputList)
+{
+    try {
+        buffer = readFileBuffer(filename, filenames);
+    } catch (const simplecpp::Output &e) {
+        if (outputList)
+            outputList->emplace_back(e);
+        return;
+    }
+    stream.reset(new StdCharBufStream(buffer.data(), buffer.size()));
+    buffered = true;
+    init(filename, skipComments);
+}
+
+simplecpp::TokenStream::TokenStream(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, bool skipComments)
+    : list(filenames), outputList(outputList), stream(new StdIStream(istr))
+{
+    init(filename, skipComments);
+}
+
+simplecpp::TokenStream::~TokenStream()
+{
+    for (const Token *tok : detached)
+        delete tok;
+}
+
+void simplecpp::TokenStream::init(const std::string &filename, bool skipComments)
+{
+    // the stream keeps pointers into the list while it lexes more lines
+    list.pinned = true;
+    if (stream->utf16()) {
+        std::vector<unsigned char> utf8 = stream->decodeUtf16();
+        stream.reset(new StdCharBufStream(utf8.data(), utf8.size()));
+        buffer.swap(utf8);
+        buffered = true;
+    }
+    state.reset(new TokenList::LexState(Location(list.fileIndex(filename), 1, 1), skipComments, nullptr));
+    more = true;
+    // preprocess() starts at the first token
+    while (more && (!readyEnd || readyEnd == list.cfront())) {
+        if (!lexMore())
+            break;
+    }
+    prepareTok = list.cfront();
+}
+
+bool simplecpp::TokenStream::lexMore()
+{
+    state->pauseLines = STREAM_CHUNK_LINES;
+    if (buffered)
+        more = list.readStream(static_cast<StdCharBufStream &>(*stream), *state, outputList);
+    else
+        more = list.readStream(*stream, *state, outputList);
+    if (state->failed) {
+        readyEnd = readyScan = nullptr;
+        prepareTok = nullptr;
+        return false;
+    }
+    if (more)
+        updateReady();
+    return true;
+}
+
+void simplecpp::TokenStream::updateReady()
+{
+    Token * const combineTok = state->combineTok;
+    if (!combineTok || !combineTok->previous)
+        return;
+
+    // The lexer can still delete the token before the next one it combines
+    // and it looks at the line that ends with the last final token.
+    const Token * const uncombined = combineTok->previous;
+    const Token *lineStartTok = state->finalTok;
+    bool uncombinedOnLine = (lineStartTok == uncombined);
+    while (sameline(lineStartTok->previous, lineStartTok)) {
+        lineStartTok = lineStartTok->previous;
+        if (lineStartTok == uncombined)
+            uncombinedOnLine = true;
+    }
+    const Token * const stableEnd = uncombinedOnLine ? lineStartTok : uncombined;
+
+    // The tokens before newReady can be deleted when the combineOperators()
+    // checks that look back never get past it: there is no open parenthesis
+    // before it and the "&=" check stops at it.
+    Token *newReady = nullptr;
+    for (Token *tok = readyScan ? readyScan->next : list.front(); tok != stableEnd; tok = tok->next) {
+        const bool nameLike = tok->name || tok->op == '*' || tok->op == '&' || tok->str() == "::";
+        if (readyDepth == readyMinDepth && !tok->comment && tok->op != '(' &&
+            (!nameLike || !tok->previous || (!tok->previous->mCommentAhead && tok->previous->isOneOf(";{}:"))))
+            newReady = tok;
+        if (tok->op == '(')
+            ++readyDepth;
+        else if (tok->op == ')' && --readyDepth < readyMinDepth)
+            readyMinDepth = readyDepth;
+        readyScan = tok;
+    }
+    if (!newReady)
+        return;
+
+    readyEnd = newReady;
+}
+
+bool simplecpp::TokenStream::prepare(const Token *tok)
+{
+    if (!more || tok != prepareTok)
+        return true;
+
+    // the line is prepared when the parentheses opened after tok are closed
+    // at the end of a line, a function like macro name at the end of the
+    // line can be called with arguments on the next lines
+    int depth = 0;
+    int minDepth = 0;
+    for (;;) {
+        if (tok->op == '(')
+            ++depth;
+        else if (tok->op == ')' && --depth < minDepth)
+            minDepth = depth;
+        while (more && tok->next == readyEnd) {
+            if (!lexMore())
+                return false;
+        }
+        const Token * const next = tok->next;
+        if (!next || (!sameline(tok, next) && depth == minDepth && next->op != '(')) {
+            prepareTok = next;
+            return true;
+        }
+        tok = next;
+    }
+}
+
+bool simplecpp::TokenStream::prepareAll()
+{
+    while (more) {
+        if (!lexMore())
+            return false;
+    }
+    return !state || !state->failed;
+}
+
+void simplecpp::TokenStream::release(const Token *tok, const std::vector<const Token *> &keep)
+{
+    for (std::vector<Token *>::iterator it = detached.begin(); it != detached.end();) {
+        if (std::find(keep.cbegin(), keep.cend(), *it) == keep.cend()) {
+            delete *it;
+            it = detached.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // preprocess() looks at the token before tok to see if tok starts a directive
+    const Token * const end = tok->previousSkipComments();
+    if (!end)
+        return;
+    while (list.cfront() != end) {
+        Token * const front = list.front();
+        if (front->name && std::find(keep.cbegin(), keep.cend(), front) != keep.cend()) {
+            list.frontToken = front->next;
+            list.frontToken->previous = nullptr;
+            front->next = nullptr;
+            detached.push_back(front);
+        } else {
+            list.deleteToken(front);
+        }
+    }
 }
 
 void simplecpp::TokenList::constFold()
 {
+    unshare();
     while (cfront()) {
         // goto last '('
         Token *tok = back();
@@ -1013,131 +2433,154 @@ static bool isAlternativeAndBitandBitor(const simplecpp::Token* tok)
     return isAlternativeBinaryOp(tok, AND) || isAlternativeBinaryOp(tok, BITAND) || isAlternativeBinaryOp(tok, BITOR);
 }
 
-void simplecpp::TokenList::combineOperators()
+void simplecpp::TokenList::combineOperators(Token *tok, std::vector<bool> &executableScope, bool frontCommentAhead)
 {
-    std::stack<bool> executableScope;
-    executableScope.push(false);
-    for (Token *tok = front(); tok; tok = tok->next) {
-        if (tok->op == '{') {
-            if (executableScope.top()) {
-                executableScope.push(true);
-                continue;
-            }
-            const Token *prev = tok->previous;
-            while (prev && prev->isOneOf(";{}()"))
-                prev = prev->previous;
-            executableScope.push(prev && prev->op == ')');
-            continue;
-        }
-        if (tok->op == '}') {
-            if (executableScope.size() > 1)
-                executableScope.pop();
-            continue;
+    // A skipped comment after a token keeps it apart from the next token
+    // like a comment token would. tok takes it over when it is combined
+    // with the token before the comment.
+    const auto deleteNext = [&]() {
+        tok->mCommentAhead = tok->next->mCommentAhead;
+        deleteToken(tok->next);
+    };
+
+    if (tok->op == '{') {
+        if (executableScope.back()) {
+            executableScope.push_back(true);
+            return;
         }
+        const Token *prev = tok->previous;
+        while (prev && !prev->mCommentAhead && prev->isOneOf(";{}()"))
+            prev = prev->previous;
+        executableScope.push_back(prev && !prev->mCommentAhead && prev->op == ')');
+        return;
+    }
+    if (tok->op == '}') {
+        if (executableScope.size() > 1)
+            executableScope.pop_back();
+        return;
+    }
 
-        if (tok->op == '.') {
-            // ellipsis ...
-            if (tok->next && tok->next->op == '.' && tok->next->location.col == (tok->location.col + 1) &&
-                tok->next->next && tok->next->next->op == '.' && tok->next->next->location.col == (tok->location.col + 2)) {
-                tok->setstr("...");
-                deleteToken(tok->next);
-                deleteToken(tok->next);
-                continue;
-            }
-            // float literals..
-            if (tok->previous && tok->previous->number && sameline(tok->previous, tok) && tok->previous->str().find_first_of("._") == std::string::npos) {
-                tok->setstr(tok->previous->str() + '.');
-                deleteToken(tok->previous);
-                if (sameline(tok, tok->next) && (isFloatSuffix(tok->next) || (tok->next && tok->next->startsWithOneOf("AaBbCcDdEeFfPp") && !isAlternativeAndBitandBitor(tok->next)))) {
-                    tok->setstr(tok->str() + tok->next->str());
-                    deleteToken(tok->next);
-                }
-            }
-            if (tok->next && tok->next->number) {
+    if (tok->op == '.') {
+        // ellipsis ...
+        if (!tok->mCommentAhead && tok->next && tok->next->op == '.' && tok->next->location.col == (tok->location.col + 1) &&
+            !tok->next->mCommentAhead && tok->next->next && tok->next->next->op == '.' && tok->next->next->location.col == (tok->location.col + 2)) {
+            tok->setstr("...");
+            deleteNext();
+            deleteNext();
+            return;
+        }
+        // float literals..
+        if (tok->previous && !tok->previous->mCommentAhead && tok->previous->number && sameline(tok->previous, tok) && tok->previous->str().find_first_of("._") == std::string::npos) {
+            tok->setstr(tok->previous->str() + '.');
+            deleteToken(tok->previous);
+            if (!tok->mCommentAhead && sameline(tok, tok->next) && (isFloatSuffix(tok->next) || (tok->next && tok->next->startsWithOneOf("AaBbCcDdEeFfPp") && !isAlternativeAndBitandBitor(tok->next)))) {
                 tok->setstr(tok->str() + tok->next->str());
-                deleteToken(tok->next);
+                deleteNext();
             }
         }
-        // match: [0-9.]+E [+-] [0-9]+
-        const char lastChar = tok->str()[tok->str().size() - 1];
-        if (tok->number && !isOct(tok->str()) &&
-            ((!isHex(tok->str()) && (lastChar == 'E' || lastChar == 'e')) ||
-             (isHex(tok->str()) && (lastChar == 'P' || lastChar == 'p'))) &&
-            tok->next && tok->next->isOneOf("+-") && tok->next->next && tok->next->next->number) {
-            tok->setstr(tok->str() + tok->next->op + tok->next->next->str());
-            deleteToken(tok->next);
-            deleteToken(tok->next);
+        if (!tok->mCommentAhead && tok->next && tok->next->number) {
+            tok->setstr(tok->str() + tok->next->str());
+            deleteNext();
         }
+    }
+    // match: [0-9.]+E [+-] [0-9]+
+    const char lastChar = tok->str()[tok->str().size() - 1];
+    if (tok->number && !isOct(tok->str()) &&
+        ((!isHex(tok->str()) && (lastChar == 'E' || lastChar == 'e')) ||
+         (isHex(tok->str()) && (lastChar == 'P' || lastChar == 'p'))) &&
+        !tok->mCommentAhead && tok->next && tok->next->isOneOf("+-") && !tok->next->mCommentAhead && tok->next->next && tok->next->next->number) {
+        tok->setstr(tok->str() + tok->next->op + tok->next->next->str());
+        deleteNext();
+        deleteNext();
+    }
 
-        if (tok->op == '\0' || !tok->next || tok->next->op == '\0')
-            continue;
-        if (!sameline(tok,tok->next))
-            continue;
-        if (tok->location.col + 1U != tok->next->location.col)
-            continue;
+    // the lexer combines "<<" and ">>", "<<=" and ">>=" are combined here.
+    // The lexer might have combined "==" after it already.
+    if (tok->op == '\0' && (tok->str() == "<<" || tok->str() == ">>")) {
+        if (!tok->mCommentAhead && tok->next && tok->next->op == '=' &&
+            (tok->next->mCommentAhead || (tok->next->next && tok->next->next->str()[0] != '='))) {
+            tok->setstr(tok->str() + tok->next->str());
+            deleteNext();
+        }
+        return;
+    }
+
+    if (tok->op == '\0' || tok->mCommentAhead || !tok->next || tok->next->op == '\0')
+        return;
+    if (!sameline(tok,tok->next))
+        return;
+    if (tok->location.col + 1U != tok->next->location.col)
+        return;
 
-        if (tok->next->op == '=' && tok->isOneOf("=!<>+-*/%&|^")) {
-            if (tok->op == '&' && !executableScope.top()) {
-                // don't combine &= if it is a anonymous reference parameter with default value:
-                // void f(x&=2)
-                int indentlevel = 0;
-                const Token *start = tok;
-                while (indentlevel >= 0 && start) {
-                    if (start->op == ')')
-                        ++indentlevel;
-                    else if (start->op == '(')
-                        --indentlevel;
-                    else if (start->isOneOf(";{}"))
-                        break;
-                    start = start->previous;
-                }
-                if (indentlevel == -1 && start) {
-                    const Token * const ftok = start;
-                    bool isFuncDecl = ftok->name;
-                    while (isFuncDecl) {
-                        if (!start->name && start->str() != "::" && start->op != '*' && start->op != '&')
+    if (tok->next->op == '=' && tok->isOneOf("=!<>+-*/%&|^")) {
+        if (tok->op == '&' && !executableScope.back()) {
+            // don't combine &= if it is a anonymous reference parameter with default value:
+            // void f(x&=2)
+            int indentlevel = 0;
+            const Token *start = tok;
+            while (indentlevel >= 0 && start) {
+                if (start->op == ')')
+                    ++indentlevel;
+                else if (start->op == '(')
+                    --indentlevel;
+                else if (start->isOneOf(";{}"))
+                    break;
+                start = start->previous;
+            }
+            if (indentlevel == -1 && start) {
+                const Token * const ftok = start;
+                bool isFuncDecl = ftok->name && !ftok->mCommentAhead;
+                while (isFuncDecl) {
+                    if (!start->name && start->str() != "::" && start->op != '*' && start->op != '&')
+                        isFuncDecl = false;
+                    if (!start->previous) {
+                        if (frontCommentAhead)
                             isFuncDecl = false;
-                        if (!start->previous)
-                            break;
-                        if (start->previous->isOneOf(";{}:"))
-                            break;
-                        start = start->previous;
+                        break;
                     }
-                    isFuncDecl &= start != ftok && start->name;
-                    if (isFuncDecl) {
-                        // TODO: we could loop through the parameters here and check if they are correct.
-                        continue;
+                    if (start->previous->mCommentAhead) {
+                        isFuncDecl = false;
+                        break;
                     }
+                    if (start->previous->isOneOf(";{}:"))
+                        break;
+                    start = start->previous;
+                }
+                isFuncDecl &= start != ftok && start->name;
+                if (isFuncDecl) {
+                    // TODO: we could loop through the parameters here and check if they are correct.
+                    return;
                 }
             }
-            tok->setstr(tok->str() + "=");
-            deleteToken(tok->next);
-        } else if ((tok->op == '|' || tok->op == '&') && tok->op == tok->next->op) {
-            tok->setstr(tok->str() + tok->next->str());
-            deleteToken(tok->next);
-        } else if (tok->op == ':' && tok->next->op == ':') {
-            tok->setstr(tok->str() + tok->next->str());
-            deleteToken(tok->next);
-        } else if (tok->op == '-' && tok->next->op == '>') {
-            tok->setstr(tok->str() + tok->next->str());
-            deleteToken(tok->next);
-        } else if ((tok->op == '<' || tok->op == '>') && tok->op == tok->next->op) {
-            tok->setstr(tok->str() + tok->next->str());
-            deleteToken(tok->next);
-            if (tok->next && tok->next->op == '=' && tok->next->next && tok->next->next->op != '=') {
-                tok->setstr(tok->str() + tok->next->str());
-                deleteToken(tok->next);
-            }
-        } else if ((tok->op == '+' || tok->op == '-') && tok->op == tok->next->op) {
-            if (tok->location.col + 1U != tok->next->location.col)
-                continue;
-            if (tok->previous && tok->previous->number)
-                continue;
-            if (tok->next->next && tok->next->next->number)
-                continue;
+        }
+        tok->setstr(tok->str() + "=");
+        deleteNext();
+    } else if ((tok->op == '|' || tok->op == '&') && tok->op == tok->next->op) {
+        tok->setstr(tok->str() + tok->next->str());
+        deleteNext();
+    } else if (tok->op == ':' && tok->next->op == ':') {
+        tok->setstr(tok->str() + tok->next->str());
+        deleteNext();
+    } else if (tok->op == '-' && tok->next->op == '>') {
+        tok->setstr(tok->str() + tok->next->str());
+        deleteNext();
+    } else if ((tok->op == '<' || tok->op == '>') && tok->op == tok->next->op) {
+        tok->setstr(tok->str() + tok->next->str());
+        deleteNext();
+        if (!tok->mCommentAhead && tok->next && tok->next->op == '=' &&
+            (tok->next->mCommentAhead || (tok->next->next && tok->next->next->str()[0] != '='))) {
             tok->setstr(tok->str() + tok->next->str());
-            deleteToken(tok->next);
+            deleteNext();
         }
+    } else if ((tok->op == '+' || tok->op == '-') && tok->op == tok->next->op) {
+        if (tok->location.col + 1U != tok->next->location.col)
+            return;
+        if (tok->previous && !tok->previous->mCommentAhead && tok->previous->number)
+            return;
+        if (!tok->next->mCommentAhead && tok->next->next && tok->next->next->number)
+            return;
+        tok->setstr(tok->str() + tok->next->str());
+        deleteNext();
     }
 }
 
@@ -1166,7 +2609,7 @@ void simplecpp::TokenList::constFoldUnaryNotPosNeg(simplecpp::Token *tok)
                 continue;
             switch (tok->op) {
             case '+':
-                tok->setstr(tok->next->str());
+                tok->setstr(tok->next->text());
                 deleteToken(tok->next);
                 break;
             case '-':
@@ -1388,6 +2831,7 @@ void simplecpp::TokenList::constFoldQuestionOp(Token *&tok1)
 
 void simplecpp::TokenList::removeComments()
 {
+    unshare();
     Token *tok = frontToken;
     while (tok) {
         Token * const tok1 = tok;
@@ -1397,7 +2841,8 @@ void simplecpp::TokenList::removeComments()
     }
 }
 
-std::string simplecpp::TokenList::readUntil(Stream &stream, const Location &location, const char start, const char end, OutputList *outputList)
+template<class StreamT>
+std::string simplecpp::TokenList::readUntil(StreamT &stream, const Location &location, const char start, const char end, OutputList *outputList)
 {
     std::string ret;
     ret += start;
@@ -1405,6 +2850,8 @@ std::string simplecpp::TokenList::readUntil(Stream &stream, const Location &loca
     bool backslash = false;
     char ch = 0;
     while (ch != end && ch != '\r' && ch != '\n' && stream.good()) {
+        if (!backslash)
+            stream.appendPlain(ret, end);
         ch = stream.readChar();
         if (backslash && ch == '\n') {
             ch = 0;
@@ -1447,30 +2894,16 @@ std::string simplecpp::TokenList::readUntil(Stream &stream, const Location &loca
     return ret;
 }
 
-const simplecpp::Token* simplecpp::TokenList::lastLineTok(int maxsize) const
+const simplecpp::Token* simplecpp::TokenList::lastLineTok() const
 {
     const Token* prevTok = nullptr;
-    int count = 0;
-    for (const Token *tok = cback(); ; tok = tok->previous) {
-        if (!sameline(tok, cback()))
-            break;
-        if (tok->comment)
-            continue;
-        if (++count > maxsize)
-            return nullptr;
-        prevTok = tok;
+    for (const Token *tok = cback(); sameline(tok, cback()); tok = tok->previous) {
+        if (!tok->comment)
+            prevTok = tok;
     }
     return prevTok;
 }
 
-const simplecpp::Token* simplecpp::TokenList::isLastLinePreprocessor(int maxsize) const
-{
-    const Token * const prevTok = lastLineTok(maxsize);
-    if (prevTok && prevTok->op == '#')
-        return prevTok;
-    return nullptr;
-}
-
 unsigned int simplecpp::TokenList::fileIndex(const std::string &filename)
 {
     for (unsigned int i = 0; i < files.size(); ++i) {
@@ -1490,35 +2923,282 @@ const std::string& simplecpp::TokenList::file(const Location& loc) const
 
 namespace simplecpp {
     class Macro;
-    using MacroMap = std::unordered_map<TokenString,Macro>;
+    using MacroMap = std::unordered_map<InternedString,Macro,InternedString::Hash>;
+
+    /**
+     * The names of the macros that are being expanded. Each set is a node,
+     * usually on the stack, that adds a name to or removes a name from the
+     * set it extends, so deriving a set does not copy or allocate.
+     */
+    class HideSet {
+    public:
+        HideSet() = default;
+
+        /** the parent set with name added (hidden=true) or removed (hidden=false) */
+        HideSet(const HideSet &parent, const InternedString &name, bool hidden)
+            : mParent(&parent), mName(name), mHidden(hidden), mSize(parent.mSize) {
+            if (parent.contains(name) != hidden)
+                mSize = hidden ? mSize + 1U : mSize - 1U;
+        }
+
+        HideSet(const HideSet &) = delete;
+        HideSet &operator=(const HideSet &) = delete;
+
+        bool contains(const InternedString &name) const {
+            // the innermost node for the name decides
+            for (const HideSet *set = this; set->mParent; set = set->mParent) {
+                if (set->mName == name)
+                    return set->mHidden;
+            }
+            return false;
+        }
+
+        unsigned int size() const {
+            return mSize;
+        }
+
+    private:
+        const HideSet *mParent{};
+        InternedString mName;
+        bool mHidden{};
+        unsigned int mSize{};
+    };
+
+    /**
+     * Expansions of macro calls that are seen again are replayed from this
+     * cache. The names that an expansion looks up are remembered, and a
+     * #define or #undef of one of them clears the cache. The cache is
+     * bounded, when it is full calls are expanded without recording them.
+     */
+    class ExpansionCache {
+    public:
+        struct Entry {
+            explicit Entry(std::vector<std::string> &files) : tokens(files) {}
+
+            const Macro *macro{};
+            /** text and whitespace of the call tokens */
+            std::vector<std::pair<InternedString, bool>> call;
+            /** location of the recorded call, it is replaced by the location of a replayed call */
+            Location location;
+            TokenList tokens;
+            /** usage of the macros that were expanded */
+            std::vector<std::pair<const Macro *, Location>> usage;
+        };
+
+        /** records the expansion of a call, store() adds it to the cache */
+        class Recording {
+        public:
+            Recording(ExpansionCache &cache, std::size_t hash, const Macro *macro, const InternedString &name, const Token *call, const Token *end, const Location &loc, std::vector<std::string> &files)
+                : mCache(cache), mHash(hash), mEntry(new Entry(files)) {
+                mEntry->macro = macro;
+                for (const Token *tok = call; tok != end; tok = tok->next)
+                    mEntry->call.emplace_back(tok->text(), tok->whitespaceahead);
+                mEntry->location = loc;
+                if (!mCache.mRecording) {
+                    mCache.mRecording = mEntry.get();
+                    mCache.mUncacheable = false;
+                    mCache.mDependencies.insert(name);
+                }
+            }
+
+            ~Recording() {
+                if (mCache.mRecording == mEntry.get())
+                    mCache.mRecording = nullptr;
+            }
+
+            Recording(const Recording &) = delete;
+            Recording &operator=(const Recording &) = delete;
+
+            /** add the tokens after last to the cache, unless the expansion can not be replayed */
+            void store(const TokenList &output, const Token *last) {
+                if (mCache.mRecording != mEntry.get())
+                    return;
+                mCache.mRecording = nullptr;
+                if (mCache.mUncacheable)
+                    return;
+                const Token * const first = last ? last->next : output.cfront();
+                std::size_t size = mEntry->call.size();
+                for (const Token *tok = first; tok; tok = tok->next)
+                    ++size;
+                // a full cache keeps the entries it has
+                if (mCache.mTokens + size > MAX_TOKENS)
+                    return;
+                for (const Token *tok = first; tok; tok = tok->next)
+                    mEntry->tokens.push_back(new Token(*tok));
+                mCache.mTokens += size;
+                mCache.mEntries.emplace(mHash, std::move(mEntry));
+            }
+
+        private:
+            ExpansionCache &mCache;
+            const std::size_t mHash;
+            std::unique_ptr<Entry> mEntry;
+        };
+
+        /** the call and expansion tokens that are kept at most */
+        static const std::size_t MAX_TOKENS = 1U << 20;
+        /** the distinct calls that are remembered at most */
+        static const std::size_t MAX_SEEN = 1U << 16;
+
+        ExpansionCache() = default;
+        ExpansionCache(const ExpansionCache &) = delete;
+        ExpansionCache &operator=(const ExpansionCache &) = delete;
+
+        static std::size_t hash(const Macro *macro, const Token *call, const Token *end) {
+            std::size_t h = std::hash<const Macro *>()(macro);
+            for (const Token *tok = call; tok != end; tok = tok->next)
+                h = h * 31U + tok->text().hash() * 2U + (tok->whitespaceahead ? 1U : 0U);
+            return h;
+        }
+
+        const Entry *find(std::size_t hash, const Macro *macro, const Token *call, const Token *end) const {
+            const auto range = mEntries.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                const Entry &entry = *it->second;
+                if (entry.macro != macro)
+                    continue;
+                const Token *tok = call;
+                auto calltok = entry.call.cbegin();
+                for (; tok != end && calltok != entry.call.cend(); tok = tok->next, ++calltok) {
+                    if (tok->text() != calltok->first || tok->whitespaceahead != calltok->second)
+                        break;
+                }
+                if (tok == end && calltok == entry.call.cend())
+                    return &entry;
+            }
+            return nullptr;
+        }
+
+        /** has a call with this hash been seen before? calls are recorded when they are seen again */
+        bool seen(std::size_t hash) {
+            if (mSeen.size() >= MAX_SEEN)
+                return mSeen.find(hash) != mSeen.end();
+            return !mSeen.insert(hash).second;
+        }
+
+        /** a macro with this name is defined or undefined */
+        void changed(const InternedString &name) {
+            if (mDependencies.find(name) != mDependencies.end()) {
+                mEntries.clear();
+                mDependencies.clear();
+                mTokens = 0;
+            }
+        }
+
+        /** the recorded expansion looks up a macro */
+        void lookup(const InternedString &name) {
+            if (mRecording)
+                mDependencies.insert(name);
+        }
+
+        /** the recorded expansion uses a macro */
+        void used(const Macro *macro, const Location &loc) {
+            if (mRecording)
+                mRecording->usage.emplace_back(macro, loc);
+        }
+
+        /** the recorded expansion depends on its location or on the number of uses of a macro */
+        void uncacheable() {
+            if (mRecording)
+                mUncacheable = true;
+        }
+
+        static bool isCallLocation(const Entry &entry, const Location &loc) {
+            return loc.sameline(entry.location) && loc.col == entry.location.col;
+        }
+
+    private:
+        Entry *mRecording{};
+        bool mUncacheable{};
+        std::unordered_multimap<std::size_t, std::unique_ptr<Entry>> mEntries;
+        /** number of call and expansion tokens in mEntries */
+        std::size_t mTokens{};
+        std::unordered_set<std::size_t> mSeen;
+        std::unordered_set<InternedString, InternedString::Hash> mDependencies;
+    };
+
+    /**
+     * A macro call at the top level is expanded straight from the raw
+     * tokens instead of from a copy without line breaks. While the call is
+     * expanded its tokens are logically at the location of the call, as
+     * the copies were.
+     */
+    class CallView {
+    public:
+        CallView(const Location &loc, const Token *last)
+            : mFirst(loc), mLast(last->location) {}
+
+        /** the location of a token, for a token of the call this is the location of the call */
+        const Location &location(const Token *tok) const {
+            const Location &loc = tok->location;
+            if (loc.fileIndex == mFirst.fileIndex && !(loc < mFirst) && !(mLast < loc))
+                return mFirst;
+            return loc;
+        }
+
+    private:
+        const Location mFirst;
+        const Location mLast;
+    };
+
+    /**
+     * What the expand functions share while a macro call is expanded: the
+     * macros, the expansion cache of the preprocess() call if there is one,
+     * and the top level call that is expanded from the raw tokens.
+     */
+    struct ExpandContext {
+        const MacroMap &macros;
+        ExpansionCache *cache;
+        const CallView *view;
+
+        /** the location of a token, for a token of the top level call this is the location of the call */
+        const Location &location(const Token *tok) const {
+            return view ? view->location(tok) : tok->location;
+        }
+
+        void lookup(const InternedString &name) const {
+            if (cache)
+                cache->lookup(name);
+        }
+
+        void used(const Macro *macro, const Location &loc) const {
+            if (cache)
+                cache->used(macro, loc);
+        }
+
+        void uncacheable() const {
+            if (cache)
+                cache->uncacheable();
+        }
+    };
 
     class Macro {
     public:
-        explicit Macro(std::vector<std::string> &f) : nameTokDef(nullptr), valueToken(nullptr), endToken(nullptr), files(f), tokenListDefine(f), variadic(false), variadicOpt(false), valueDefinedInCode_(false) {}
+        explicit Macro(std::vector<std::string> &f) : nameTokDef(nullptr), valueToken(nullptr), endToken(nullptr), files(f), tokenListDefine(f), variadic(false), variadicOpt(false), valueDefinedInCode_(false), deferred(false) {}
 
         /**
          * @throws std::runtime_error thrown on bad macro syntax
          */
-        Macro(const Token *tok, std::vector<std::string> &f) : nameTokDef(nullptr), files(f), tokenListDefine(f), valueDefinedInCode_(true) {
+        Macro(const Token *tok, std::vector<std::string> &f) : nameTokDef(nullptr), valueToken(nullptr), endToken(nullptr), files(f), tokenListDefine(f), variadic(false), variadicOpt(false), valueDefinedInCode_(true), deferred(false) {
             if (sameline(tok->previousSkipComments(), tok))
                 throw std::runtime_error("bad macro syntax");
             if (tok->op != '#')
                 throw std::runtime_error("bad macro syntax");
             const Token * const hashtok = tok;
             tok = tok->next;
-            if (!tok || tok->str() != DEFINE)
+            if (!tok || tok->keyword() != KwDefine)
                 throw std::runtime_error("bad macro syntax");
             tok = tok->next;
             if (!tok || !tok->name || !sameline(hashtok,tok))
                 throw std::runtime_error("bad macro syntax");
-            if (!parseDefine(tok))
+            if (!deferDefine(tok) && !parseDefine(tok))
                 throw std::runtime_error("bad macro syntax");
         }
 
         /**
          * @throws std::runtime_error thrown on bad macro syntax
          */
-        Macro(const std::string &name, const std::string &value, std::vector<std::string> &f) : nameTokDef(nullptr), files(f), tokenListDefine(f), valueDefinedInCode_(false) {
+        Macro(const std::string &name, const std::string &value, std::vector<std::string> &f) : nameTokDef(nullptr), files(f), tokenListDefine(f), valueDefinedInCode_(false), deferred(false) {
             const std::string def(name + ' ' + value);
             StdCharBufStream stream(reinterpret_cast<const unsigned char*>(def.data()), def.size());
             tokenListDefine.readfile(stream);
@@ -1526,31 +3206,30 @@ namespace simplecpp {
                 throw std::runtime_error("bad macro syntax. macroname=" + name + " value=" + value);
         }
 
-        Macro(const Macro &other) : nameTokDef(nullptr), files(other.files), tokenListDefine(other.files), valueDefinedInCode_(other.valueDefinedInCode_) {
-            // TODO: remove the try-catch - see #537
-            // avoid bugprone-exception-escape clang-tidy warning
-            try {
-                *this = other;
-            }
-            catch (const Error&) {} // NOLINT(bugprone-empty-catch)
-        }
+        Macro(const Macro &other) = delete;
+        Macro &operator=(const Macro &other) = delete;
 
-        ~Macro() {
-            delete optExpandValue;
-            delete optNoExpandValue;
+        /** a macro is parsed once and then moved into the MacroMap */
+        Macro(Macro &&other) : files(other.files), tokenListDefine(other.files) {
+            *this = std::move(other);
         }
 
-        Macro &operator=(const Macro &other) {
+        Macro &operator=(Macro &&other) {
             if (this != &other) {
-                files = other.files;
+                if (&files != &other.files)
+                    files = other.files;
+                nameTokDef = other.nameTokDef;
+                args = std::move(other.args);
+                valueToken = other.valueToken;
+                endToken = other.endToken;
+                tokenListDefine = std::move(other.tokenListDefine);
+                usageList = std::move(other.usageList);
+                variadic = other.variadic;
+                variadicOpt = other.variadicOpt;
+                optExpandValue = std::move(other.optExpandValue);
+                optNoExpandValue = std::move(other.optNoExpandValue);
                 valueDefinedInCode_ = other.valueDefinedInCode_;
-                if (other.tokenListDefine.empty())
-                    parseDefine(other.nameTokDef);
-                else {
-                    tokenListDefine = other.tokenListDefine;
-                    parseDefine(tokenListDefine.cfront());
-                }
-                usageList = other.usageList;
+                deferred = other.deferred;
             }
             return *this;
         }
@@ -1559,11 +3238,25 @@ namespace simplecpp {
             return valueDefinedInCode_;
         }
 
+        /** copy the definition so the macro does not refer to the tokens it was parsed from */
+        void copyDefinition() {
+            if (!tokenListDefine.empty())
+                return;
+            const Token *tok = nameTokDef;
+            for (; sameline(tok, nameTokDef); tok = tok->next)
+                tokenListDefine.push_back(new Token(*tok));
+            // the token after the definition ends the body, as in rawtokens
+            if (tok)
+                tokenListDefine.push_back(new Token(*tok));
+            parseDefine(tokenListDefine.cfront());
+        }
+
         /**
          * Expand macro. This will recursively expand inner macros.
          * @param output     destination tokenlist
          * @param rawtok     macro token
          * @param macros     list of macros
+         * @param cache      expansion cache of the preprocess() call, or nullptr
          * @param inputFiles the input files
          * @return token after macro
          * @throws Error thrown on missing or invalid preprocessor directives
@@ -1573,8 +3266,12 @@ namespace simplecpp {
         const Token * expand(TokenList & output,
                              const Token * rawtok,
                              const MacroMap &macros,
+                             ExpansionCache *cache,
                              std::vector<std::string> &inputFiles) const {
-            std::set<TokenString> expandedmacros;
+            const ExpandContext ctx{macros, cache, nullptr};
+            const HideSet noMacros;
+            const HideSet thisMacro(noMacros, key(), true);
+            const HideSet *expandedmacros = &noMacros;
 
 #ifdef SIMPLECPP_DEBUG_MACRO_EXPANSION
             std::cout << "expand " << name() << " " << locstring(rawtok->location) << std::endl;
@@ -1583,13 +3280,10 @@ namespace simplecpp {
             TokenList output2(inputFiles);
 
             if (functionLike() && rawtok->next && rawtok->next->op == '(') {
-                // Copy macro call to a new tokenlist with no linebreaks
+                // The call is expanded from the raw tokens, the view removes its linebreaks
                 const Token * const rawtok1 = rawtok;
-                TokenList rawtokens2(inputFiles);
-                rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
-                rawtok = rawtok->next;
-                rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
-                rawtok = rawtok->next;
+                const Token *last = rawtok->next;
+                rawtok = last->next;
                 int par = 1;
                 while (rawtok && par > 0) {
                     if (rawtok->op == '(')
@@ -1598,50 +3292,57 @@ namespace simplecpp {
                         --par;
                     else if (rawtok->op == '#' && !sameline(rawtok->previous, rawtok))
                         throw Error(rawtok->location, "it is invalid to use a preprocessor directive as macro parameter");
-                    rawtokens2.push_back(new Token(rawtok->str(), rawtok1->location, rawtok->whitespaceahead));
+                    last = rawtok;
                     rawtok = rawtok->next;
                 }
-                if (expand(output2, rawtok1->location, rawtokens2.cfront(), macros, expandedmacros))
+                const CallView view(rawtok1->location, last);
+                const ExpandContext callCtx{macros, cache, &view};
+                if (expandCached(output2, rawtok1->location, rawtok1, rawtok, callCtx) != rawtok)
                     rawtok = rawtok1->next;
+            } else if (!functionLike()) {
+                rawtok = expandCached(output2, rawtok->location, rawtok, rawtok->next, ctx);
             } else {
-                rawtok = expand(output2, rawtok->location, rawtok, macros, expandedmacros);
+                rawtok = expand(output2, rawtok->location, rawtok, ctx, *expandedmacros);
             }
+            // the unmatched '(' in output2, each token is scanned once when
+            // it has been appended so chained calls are rescanned in linear time
+            std::vector<Token *> lpars;
+            Token *scanned = nullptr;
             while (output2.cback() && rawtok) {
-                unsigned int par = 0;
-                Token* macro2tok = output2.back();
-                while (macro2tok) {
-                    if (macro2tok->op == '(') {
-                        if (par==0)
-                            break;
-                        --par;
-                    } else if (macro2tok->op == ')')
-                        ++par;
-                    macro2tok = macro2tok->previous;
+                for (Token *tok = scanned ? scanned->next : output2.front(); tok; tok = tok->next) {
+                    if (tok->op == '(')
+                        lpars.push_back(tok);
+                    else if (tok->op == ')' && !lpars.empty())
+                        lpars.pop_back();
                 }
-                if (macro2tok) { // macro2tok->op == '('
-                    macro2tok = macro2tok->previous;
-                    expandedmacros.insert(name());
+                scanned = output2.back();
+                Token* macro2tok = nullptr;
+                if (!lpars.empty()) {
+                    macro2tok = lpars.back()->previous;
+                    lpars.pop_back();
+                    expandedmacros = &thisMacro;
                 } else if (rawtok->op == '(')
                     macro2tok = output2.back();
                 if (!macro2tok || !macro2tok->name)
                     break;
                 if (output2.cfront() != output2.cback() && macro2tok->str() == this->name())
                     break;
-                const MacroMap::const_iterator macro = macros.find(macro2tok->str());
-                if (macro == macros.end() || !macro->second.functionLike())
+                const MacroMap::const_iterator macro = ctx.macros.find(macro2tok->text());
+                if (macro == ctx.macros.end() || !macro->second.functionLike())
                     break;
                 TokenList rawtokens2(inputFiles);
                 const Location loc(macro2tok->location);
+                scanned = macro2tok->previous;
                 while (macro2tok) {
                     Token * const next = macro2tok->next;
-                    rawtokens2.push_back(new Token(macro2tok->str(), loc));
+                    rawtokens2.push_back(new Token(macro2tok->text(), loc));
                     output2.deleteToken(macro2tok);
                     macro2tok = next;
                 }
-                par = (rawtokens2.cfront() != rawtokens2.cback()) ? 1U : 0U;
+                unsigned int par = (rawtokens2.cfront() != rawtokens2.cback()) ? 1U : 0U;
                 const Token *rawtok2 = rawtok;
                 for (; rawtok2; rawtok2 = rawtok2->next) {
-                    rawtokens2.push_back(new Token(rawtok2->str(), loc));
+                    rawtokens2.push_back(new Token(rawtok2->text(), loc));
                     if (rawtok2->op == '(')
                         ++par;
                     else if (rawtok2->op == ')') {
@@ -1652,7 +3353,7 @@ namespace simplecpp {
                 }
                 if (!rawtok2 || par != 1U)
                     break;
-                if (macro->second.expand(output2, rawtok->location, rawtokens2.cfront(), macros, expandedmacros) != nullptr)
+                if (macro->second.expand(output2, rawtok->location, rawtokens2.cfront(), ctx, *expandedmacros) != nullptr)
                     break;
                 rawtok = rawtok2->next;
             }
@@ -1665,6 +3366,11 @@ namespace simplecpp {
             return nameTokDef->str();
         }
 
+        /** the interned name, this is the MacroMap key */
+        const InternedString &key() const {
+            return nameTokDef->text();
+        }
+
         /** location for macro definition */
         const Location &defineLocation() const {
             return nameTokDef->location;
@@ -1721,24 +3427,99 @@ namespace simplecpp {
             }
         };
     private:
+        /** find a macro, the lookup is a dependency of the expansion that is recorded for the cache */
+        static MacroMap::const_iterator findMacro(const ExpandContext &ctx, const InternedString &name) {
+            ctx.lookup(name);
+            return ctx.macros.find(name);
+        }
+
+        /**
+         * Expand a macro call at the top level, the call is the tokens from
+         * nameTokInst to end. A call that was expanded before with the same
+         * tokens is replayed from the expansion cache.
+         */
+        const Token *expandCached(TokenList &output, const Location &loc, const Token * const nameTokInst, const Token * const end, const ExpandContext &ctx) const {
+            const HideSet noMacros;
+            ExpansionCache * const cache = ctx.cache;
+            if (!cache)
+                return expand(output, loc, nameTokInst, ctx, noMacros);
+
+            const std::size_t hash = ExpansionCache::hash(this, nameTokInst, end);
+            if (const ExpansionCache::Entry *entry = cache->find(hash, this, nameTokInst, end)) {
+                for (const Token *tok = entry->tokens.cfront(); tok; tok = tok->next) {
+                    output.push_back(new Token(*tok));
+                    if (ExpansionCache::isCallLocation(*entry, tok->location))
+                        output.back()->location = loc;
+                }
+                for (const std::pair<const Macro *, Location> &use : entry->usage)
+                    use.first->usageList.emplace_back(ExpansionCache::isCallLocation(*entry, use.second) ? loc : use.second);
+                return end;
+            }
+            if (!cache->seen(hash))
+                return expand(output, loc, nameTokInst, ctx, noMacros);
+
+            ExpansionCache::Recording recording(*cache, hash, this, key(), nameTokInst, end, loc, files);
+            const Token * const last = output.back();
+            const Token * const next = expand(output, loc, nameTokInst, ctx, noMacros);
+            if (next == end)
+                recording.store(output, last);
+            return next;
+        }
+
         /** Create new token where Token::macro is set for replaced tokens */
         Token *newMacroToken(const TokenString &str, const Location &loc, bool replaced, const Token *expandedFromToken=nullptr) const {
+            return newMacroToken(InternedString(str), loc, replaced, expandedFromToken);
+        }
+
+        /** Create new token that shares the text of a token */
+        Token *newMacroToken(const InternedString &str, const Location &loc, bool replaced, const Token *expandedFromToken=nullptr) const {
             auto *tok = new Token(str,loc);
             if (replaced)
-                tok->macro = nameTokDef->str();
+                tok->macro = nameTokDef->text();
             if (expandedFromToken)
                 tok->setExpandedFrom(expandedFromToken, this);
             return tok;
         }
 
+        /**
+         * Record the definition without parsing the body, it is parsed when the macro is first expanded.
+         * Definitions that can be invalid are not deferred so errors are still reported at the #define.
+         */
+        bool deferDefine(const Token *nametoken) {
+            nameTokDef = nametoken;
+            if (functionLike()) {
+                const Token *argtok = nameTokDef->next->next;
+                while (sameline(nametoken, argtok) && argtok->op != ')') {
+                    // __VA_OPT__ is validated when the body is parsed
+                    if (argtok->str() == "...")
+                        return false;
+                    argtok = argtok->next;
+                }
+                if (!sameline(nametoken, argtok))
+                    return false;
+            }
+            deferred = true;
+            return true;
+        }
+
         bool parseDefine(const Token *nametoken) {
             nameTokDef = nametoken;
+            return parseBody();
+        }
+
+        /** parse the body of a deferred definition before it is expanded */
+        void ensureParsed() const {
+            if (deferred)
+                parseBody();
+        }
+
+        /** parse the parameters and the body of nameTokDef, the fields it sets are mutable for ensureParsed() */
+        bool parseBody() const {
+            deferred = false;
             variadic = false;
             variadicOpt = false;
-            delete optExpandValue;
-            optExpandValue = nullptr;
-            delete optNoExpandValue;
-            optNoExpandValue = nullptr;
+            optExpandValue.reset();
+            optNoExpandValue.reset();
             if (!nameTokDef) {
                 valueToken = endToken = nullptr;
                 args.clear();
@@ -1749,7 +3530,7 @@ namespace simplecpp {
             if (functionLike()) {
                 args.clear();
                 const Token *argtok = nameTokDef->next->next;
-                while (sameline(nametoken, argtok) && argtok->op != ')') {
+                while (sameline(nameTokDef, argtok) && argtok->op != ')') {
                     if (argtok->str() == "..." &&
                         argtok->next && argtok->next->op == ')') {
                         variadic = true;
@@ -1759,10 +3540,10 @@ namespace simplecpp {
                         break;
                     }
                     if (argtok->op != ',')
-                        args.emplace_back(argtok->str());
+                        args.push_back(argtok->text());
                     argtok = argtok->next;
                 }
-                if (!sameline(nametoken, argtok)) {
+                if (!sameline(nameTokDef, argtok)) {
                     endToken = argtok ? argtok->previous : argtok;
                     valueToken = nullptr;
                     return false;
@@ -1815,14 +3596,14 @@ namespace simplecpp {
                         tok = tok->next;
                     }
                 }
-                optExpandValue = new TokenList(std::move(expandValue));
-                optNoExpandValue = new TokenList(std::move(noExpandValue));
+                optExpandValue.reset(new TokenList(std::move(expandValue)));
+                optNoExpandValue.reset(new TokenList(std::move(noExpandValue)));
             }
 
             return true;
         }
 
-        unsigned int getArgNum(const TokenString &str) const {
+        unsigned int getArgNum(const InternedString &str) const {
             unsigned int par = 0;
             while (par < args.size()) {
                 if (str == args[par])
@@ -1857,8 +3638,8 @@ namespace simplecpp {
         const Token *appendTokens(TokenList &tokens,
                                   const Location &rawloc,
                                   const Token * const lpar,
-                                  const MacroMap &macros,
-                                  const std::set<TokenString> &expandedmacros,
+                                  const ExpandContext &ctx,
+                                  const HideSet &expandedmacros,
                                   const std::vector<const Token*> &parametertokens) const {
             if (!lpar || lpar->op != '(')
                 return nullptr;
@@ -1867,14 +3648,14 @@ namespace simplecpp {
             while (sameline(lpar, tok)) {
                 if (tok->op == '#' && sameline(tok,tok->next) && tok->next->op == '#' && sameline(tok,tok->next->next)) {
                     // A##B => AB
-                    tok = expandHashHash(tokens, rawloc, tok, macros, expandedmacros, parametertokens, false);
+                    tok = expandHashHash(tokens, rawloc, tok, ctx, expandedmacros, parametertokens, false);
                 } else if (tok->op == '#' && sameline(tok, tok->next) && tok->next->op != '#') {
                     tok = expandHash(tokens, rawloc, tok, expandedmacros, parametertokens);
                 } else {
-                    if (!expandArg(tokens, tok, rawloc, macros, expandedmacros, parametertokens)) {
+                    if (!expandArg(tokens, tok, rawloc, ctx, expandedmacros, parametertokens)) {
                         tokens.push_back(new Token(*tok));
                         if (tok->macro.empty() && (par > 0 || tok->str() != "("))
-                            tokens.back()->macro = name();
+                            tokens.back()->macro = nameTokDef->text();
                     }
 
                     if (tok->op == '(')
@@ -1892,48 +3673,56 @@ namespace simplecpp {
             return sameline(lpar,tok) ? tok : nullptr;
         }
 
-        const Token * expand(TokenList & output, const Location &loc, const Token * const nameTokInst, const MacroMap &macros, std::set<TokenString> expandedmacros) const {
-            expandedmacros.insert(nameTokInst->str());
+        const Token * expand(TokenList & output, const Location &loc, const Token * const nameTokInst, const ExpandContext &ctx, const HideSet &hidden) const {
+            const HideSet expandedmacros(hidden, nameTokInst->text(), true);
+
+            ensureParsed();
 
 #ifdef SIMPLECPP_DEBUG_MACRO_EXPANSION
             std::cout << "  expand " << name() << " " << locstring(defineLocation()) << std::endl;
 #endif
 
             usageList.emplace_back(loc);
+            ctx.used(this, loc);
 
-            if (nameTokInst->str() == "__FILE__") {
+            switch (nameTokInst->keyword()) {
+            case KwFile:
+                ctx.uncacheable();
                 output.push_back(new Token('\"'+output.file(loc)+'\"', loc));
                 return nameTokInst->next;
-            }
-            if (nameTokInst->str() == "__LINE__") {
+            case KwLine:
+                ctx.uncacheable();
                 output.push_back(new Token(toString(loc.line), loc));
                 return nameTokInst->next;
-            }
-            if (nameTokInst->str() == "__COUNTER__") {
+            case KwCounter:
+                ctx.uncacheable();
                 output.push_back(new Token(toString(usageList.size()-1U), loc));
                 return nameTokInst->next;
+            default:
+                break;
             }
 
-            const bool calledInDefine = (loc.fileIndex != nameTokInst->location.fileIndex ||
-                                         loc.line < nameTokInst->location.line);
+            const Location &instLocation = ctx.location(nameTokInst);
+            const bool calledInDefine = (loc.fileIndex != instLocation.fileIndex ||
+                                         loc.line < instLocation.line);
 
             std::vector<const Token*> parametertokens1(getMacroParameters(nameTokInst, calledInDefine));
 
             if (functionLike()) {
                 // No arguments => not macro expansion
                 if (nameTokInst->next && nameTokInst->next->op != '(') {
-                    output.push_back(new Token(nameTokInst->str(), loc));
+                    output.push_back(new Token(nameTokInst->text(), loc));
                     return nameTokInst->next;
                 }
 
                 // Parse macro-call
                 if (variadic) {
                     if (parametertokens1.size() < args.size()) {
-                        throw wrongNumberOfParameters(nameTokInst->location, name());
+                        throw wrongNumberOfParameters(instLocation, name());
                     }
                 } else {
                     if (parametertokens1.size() != args.size() + (args.empty() ? 2U : 1U))
-                        throw wrongNumberOfParameters(nameTokInst->location, name());
+                        throw wrongNumberOfParameters(instLocation, name());
                 }
             }
 
@@ -1943,23 +3732,24 @@ namespace simplecpp {
             if (!parametertokens1.empty()) {
                 bool counter = false;
                 for (const Token *tok = parametertokens1[0]; tok != parametertokens1.back(); tok = tok->next) {
-                    if (tok->str() == "__COUNTER__") {
+                    if (tok->keyword() == KwCounter) {
                         counter = true;
                         break;
                     }
                 }
 
-                const MacroMap::const_iterator m = macros.find("__COUNTER__");
+                const MacroMap::const_iterator m = counter ? ctx.macros.find(InternedString("__COUNTER__")) : ctx.macros.end();
 
-                if (!counter || m == macros.end())
+                if (!counter || m == ctx.macros.end())
                     parametertokens2.swap(parametertokens1);
                 else {
+                    ctx.uncacheable();
                     const Macro &counterMacro = m->second;
                     unsigned int par = 0;
                     for (const Token *tok = parametertokens1[0]; tok && par < parametertokens1.size(); tok = tok->next) {
-                        if (tok->str() == "__COUNTER__") {
-                            tokensparams.push_back(new Token(toString(counterMacro.usageList.size()), tok->location));
-                            counterMacro.usageList.emplace_back(tok->location);
+                        if (tok->keyword() == KwCounter) {
+                            tokensparams.push_back(new Token(toString(counterMacro.usageList.size()), ctx.location(tok)));
+                            counterMacro.usageList.emplace_back(ctx.location(tok));
                         } else {
                             tokensparams.push_back(new Token(*tok));
                             if (tok == parametertokens1[par]) {
@@ -1995,25 +3785,25 @@ namespace simplecpp {
                     if (sameline(tok, tok->next) && tok->next && tok->next->op == '#' && tok->next->next && tok->next->next->op == '#') {
                         if (!sameline(tok, tok->next->next->next))
                             throw invalidHashHash::unexpectedNewline(tok->location, name());
-                        if (variadic && tok->op == ',' && tok->next->next->next->str() == args.back()) {
-                            Token *const comma = newMacroToken(tok->str(), loc, isReplaced(expandedmacros), tok);
+                        if (variadic && tok->op == ',' && tok->next->next->next->text() == args.back()) {
+                            Token *const comma = newMacroToken(tok->text(), loc, isReplaced(expandedmacros), tok);
                             output.push_back(comma);
-                            tok = expandToken(output, loc, tok->next->next->next, macros, expandedmacros, parametertokens2);
+                            tok = expandToken(output, loc, tok->next->next->next, ctx, expandedmacros, parametertokens2);
                             if (output.back() == comma)
                                 output.deleteToken(comma);
                             continue;
                         }
                         TokenList new_output(files);
                         if (!expandArg(new_output, tok, parametertokens2))
-                            output.push_back(newMacroToken(tok->str(), loc, isReplaced(expandedmacros), tok));
+                            output.push_back(newMacroToken(tok->text(), loc, isReplaced(expandedmacros), tok));
                         else if (new_output.empty()) // placemarker token
                             output.push_back(newMacroToken("", loc, isReplaced(expandedmacros)));
                         else
                             for (const Token *tok2 = new_output.cfront(); tok2; tok2 = tok2->next)
-                                output.push_back(newMacroToken(tok2->str(), loc, isReplaced(expandedmacros), tok2));
+                                output.push_back(newMacroToken(tok2->text(), loc, isReplaced(expandedmacros), tok2));
                         tok = tok->next;
                     } else {
-                        tok = expandToken(output, loc, tok, macros, expandedmacros, parametertokens2);
+                        tok = expandToken(output, loc, tok, ctx, expandedmacros, parametertokens2);
                     }
                     continue;
                 }
@@ -2045,12 +3835,13 @@ namespace simplecpp {
                     else {
                         output.push_back(new Token(*nameTokInst));
                         output.back()->setstr("\"\"");
+                        output.back()->location = instLocation;
                     }
                     break;
                 }
                 if (tok->op == '#') {
                     // A##B => AB
-                    tok = expandHashHash(output, loc, tok->previous, macros, expandedmacros, parametertokens2);
+                    tok = expandHashHash(output, loc, tok->previous, ctx, expandedmacros, parametertokens2);
                 } else {
                     // #123 => "123"
                     tok = expandHash(output, loc, tok->previous, expandedmacros, parametertokens2);
@@ -2059,7 +3850,7 @@ namespace simplecpp {
 
             if (!functionLike()) {
                 for (Token *tok = output_end_1 ? output_end_1->next : output.front(); tok; tok = tok->next) {
-                    tok->macro = nameTokInst->str();
+                    tok->macro = nameTokInst->text();
                 }
             }
 
@@ -2069,7 +3860,7 @@ namespace simplecpp {
             return functionLike() ? parametertokens2.back()->next : nameTokInst->next;
         }
 
-        const Token *recursiveExpandToken(TokenList &output, TokenList &temp, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        const Token *recursiveExpandToken(TokenList &output, TokenList &temp, const Location &loc, const Token *tok, const ExpandContext &ctx, const HideSet &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             if (!temp.cback() || !temp.cback()->name || !tok->next || tok->next->op != '(') {
                 output.takeTokens(temp);
                 return tok->next;
@@ -2080,8 +3871,8 @@ namespace simplecpp {
                 return tok->next;
             }
 
-            const MacroMap::const_iterator it = macros.find(temp.cback()->str());
-            if (it == macros.end() || expandedmacros.find(temp.cback()->str()) != expandedmacros.end()) {
+            const MacroMap::const_iterator it = findMacro(ctx, temp.cback()->text());
+            if (it == ctx.macros.end() || expandedmacros.contains(temp.cback()->text())) {
                 output.takeTokens(temp);
                 return tok->next;
             }
@@ -2095,69 +3886,68 @@ namespace simplecpp {
             TokenList temp2(files);
             temp2.push_back(new Token(temp.cback()->str(), tok->location));
 
-            const Token * const tok2 = appendTokens(temp2, loc, tok->next, macros, expandedmacros, parametertokens);
+            const Token * const tok2 = appendTokens(temp2, loc, tok->next, ctx, expandedmacros, parametertokens);
             if (!tok2)
                 return tok->next;
             output.takeTokens(temp);
             output.deleteToken(output.back());
-            calledMacro.expand(output, loc, temp2.cfront(), macros, expandedmacros);
+            calledMacro.expand(output, loc, temp2.cfront(), ctx, expandedmacros);
             return tok2->next;
         }
 
-        const Token *expandToken(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        const Token *expandToken(TokenList &output, const Location &loc, const Token *tok, const ExpandContext &ctx, const HideSet &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             // Not name..
             if (!tok->name) {
-                output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                output.push_back(newMacroToken(tok->text(), loc, true, tok));
                 return tok->next;
             }
 
             // Macro parameter..
             {
                 TokenList temp(files);
-                if (expandArg(temp, tok, loc, macros, expandedmacros, parametertokens)) {
+                if (expandArg(temp, tok, loc, ctx, expandedmacros, parametertokens)) {
                     if (tok->str() == "__VA_ARGS__" && temp.empty() && output.cback() && output.cback()->str() == "," &&
                         tok->nextSkipComments() && tok->nextSkipComments()->str() == ")")
                         output.deleteToken(output.back());
-                    return recursiveExpandToken(output, temp, loc, tok, macros, expandedmacros, parametertokens);
+                    return recursiveExpandToken(output, temp, loc, tok, ctx, expandedmacros, parametertokens);
                 }
             }
 
             // Macro..
-            const MacroMap::const_iterator it = macros.find(tok->str());
-            if (it != macros.end() && expandedmacros.find(tok->str()) == expandedmacros.end()) {
-                std::set<std::string> expandedmacros2(expandedmacros);
-                expandedmacros2.insert(tok->str());
+            const MacroMap::const_iterator it = findMacro(ctx, tok->text());
+            if (it != ctx.macros.end() && !expandedmacros.contains(tok->text())) {
+                const HideSet expandedmacros2(expandedmacros, tok->text(), true);
 
                 const Macro &calledMacro = it->second;
                 if (!calledMacro.functionLike()) {
                     TokenList temp(files);
-                    calledMacro.expand(temp, loc, tok, macros, expandedmacros);
-                    return recursiveExpandToken(output, temp, loc, tok, macros, expandedmacros2, parametertokens);
+                    calledMacro.expand(temp, loc, tok, ctx, expandedmacros);
+                    return recursiveExpandToken(output, temp, loc, tok, ctx, expandedmacros2, parametertokens);
                 }
                 if (!sameline(tok, tok->next)) {
-                    output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                    output.push_back(newMacroToken(tok->text(), loc, true, tok));
                     return tok->next;
                 }
                 TokenList tokens(files);
                 tokens.push_back(new Token(*tok));
                 const Token * tok2 = nullptr;
                 if (tok->next->op == '(')
-                    tok2 = appendTokens(tokens, loc, tok->next, macros, expandedmacros, parametertokens);
-                else if (expandArg(tokens, tok->next, loc, macros, expandedmacros, parametertokens)) {
+                    tok2 = appendTokens(tokens, loc, tok->next, ctx, expandedmacros, parametertokens);
+                else if (expandArg(tokens, tok->next, loc, ctx, expandedmacros, parametertokens)) {
                     tokens.front()->location = loc;
                     if (tokens.cfront()->next && tokens.cfront()->next->op == '(')
                         tok2 = tok->next;
                 }
                 if (!tok2) {
-                    output.push_back(newMacroToken(tok->str(), loc, true, tok));
+                    output.push_back(newMacroToken(tok->text(), loc, true, tok));
                     return tok->next;
                 }
                 TokenList temp(files);
-                calledMacro.expand(temp, loc, tokens.cfront(), macros, expandedmacros);
-                return recursiveExpandToken(output, temp, loc, tok2, macros, expandedmacros, parametertokens);
+                calledMacro.expand(temp, loc, tokens.cfront(), ctx, expandedmacros);
+                return recursiveExpandToken(output, temp, loc, tok2, ctx, expandedmacros, parametertokens);
             }
 
-            if (tok->str() == DEFINED) {
+            if (tok->keyword() == KwDefined) {
                 const Token * const tok2 = tok->next;
                 const Token * const tok3 = tok2 ? tok2->next : nullptr;
                 const Token * const tok4 = tok3 ? tok3->next : nullptr;
@@ -2181,13 +3971,13 @@ namespace simplecpp {
                             macroName += defToken->next->next->next->str();
                         lastToken = defToken->next->next->next;
                     }
-                    const bool def = (macros.find(macroName) != macros.end());
+                    const bool def = (findMacro(ctx, InternedString(macroName)) != ctx.macros.end());
                     output.push_back(newMacroToken(def ? "1" : "0", loc, true));
                     return lastToken->next;
                 }
             }
 
-            output.push_back(newMacroToken(tok->str(), loc, true, tok));
+            output.push_back(newMacroToken(tok->text(), loc, true, tok));
             return tok->next;
         }
 
@@ -2195,7 +3985,7 @@ namespace simplecpp {
             if (!tok->name)
                 return false;
 
-            const unsigned int argnr = getArgNum(tok->str());
+            const unsigned int argnr = getArgNum(tok->text());
             if (argnr >= args.size())
                 return false;
 
@@ -2209,22 +3999,21 @@ namespace simplecpp {
             return true;
         }
 
-        bool expandArg(TokenList &output, const Token *tok, const Location &loc, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        bool expandArg(TokenList &output, const Token *tok, const Location &loc, const ExpandContext &ctx, const HideSet &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             if (!tok->name)
                 return false;
-            const unsigned int argnr = getArgNum(tok->str());
+            const unsigned int argnr = getArgNum(tok->text());
             if (argnr >= args.size())
                 return false;
             if (variadic && argnr + 1U >= parametertokens.size()) // empty variadic parameter
                 return true;
             for (const Token *partok = parametertokens[argnr]->next; partok != parametertokens[argnr + 1U];) {
-                const MacroMap::const_iterator it = macros.find(partok->str());
-                if (it != macros.end() && !partok->isExpandedFrom(&it->second) && (partok->str() == name() || expandedmacros.find(partok->str()) == expandedmacros.end())) {
-                    std::set<TokenString> expandedmacros2(expandedmacros); // temporary amnesia to allow reexpansion of currently expanding macros during argument evaluation
-                    expandedmacros2.erase(name());
-                    partok = it->second.expand(output, loc, partok, macros, std::move(expandedmacros2));
+                const MacroMap::const_iterator it = findMacro(ctx, partok->text());
+                if (it != ctx.macros.end() && !partok->isExpandedFrom(&it->second) && (partok->str() == name() || !expandedmacros.contains(partok->text()))) {
+                    const HideSet expandedmacros2(expandedmacros, key(), false); // temporary amnesia to allow reexpansion of currently expanding macros during argument evaluation
+                    partok = it->second.expand(output, loc, partok, ctx, expandedmacros2);
                 } else {
-                    output.push_back(newMacroToken(partok->str(), loc, isReplaced(expandedmacros), partok));
+                    output.push_back(newMacroToken(partok->text(), loc, isReplaced(expandedmacros), partok));
                     output.back()->macro = partok->macro;
                     partok = partok->next;
                 }
@@ -2243,20 +4032,20 @@ namespace simplecpp {
          * @param parametertokens  parameters given when expanding this macro
          * @return token after the X
          */
-        const Token *expandHash(TokenList &output, const Location &loc, const Token *tok, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens) const {
+        const Token *expandHash(TokenList &output, const Location &loc, const Token *tok, const HideSet &expandedmacros, const std::vector<const Token*> &parametertokens) const {
             TokenList tokenListHash(files);
-            const MacroMap macros2; // temporarily bypass macro expansion
-            tok = expandToken(tokenListHash, loc, tok->next, macros2, expandedmacros, parametertokens);
-            std::ostringstream ostr;
-            ostr << '\"';
+            static const MacroMap macros2; // temporarily bypass macro expansion
+            const ExpandContext ctx2{macros2, nullptr, nullptr};
+            tok = expandToken(tokenListHash, loc, tok->next, ctx2, expandedmacros, parametertokens);
+            std::string str(1U, '\"');
             for (const Token *hashtok = tokenListHash.cfront(), *next; hashtok; hashtok = next) {
                 next = hashtok->next;
-                ostr << hashtok->str();
+                str += hashtok->str();
                 if (next && hashtok->whitespaceahead)
-                    ostr << ' ';
+                    str += ' ';
             }
-            ostr << '\"';
-            output.push_back(newMacroToken(escapeString(ostr.str()), loc, isReplaced(expandedmacros)));
+            str += '\"';
+            output.push_back(newMacroToken(escapeString(str), loc, isReplaced(expandedmacros)));
             return tok;
         }
 
@@ -2266,13 +4055,13 @@ namespace simplecpp {
          * @param output  destination tokenlist
          * @param loc     location for expanded token
          * @param tok     first # token
-         * @param macros  all macros
+         * @param ctx     all macros and the expansion state
          * @param expandedmacros   set with expanded macros, with this macro
          * @param parametertokens  parameters given when expanding this macro
          * @param expandResult     expand ## result i.e. "AB"?
          * @return token after B
          */
-        const Token *expandHashHash(TokenList &output, const Location &loc, const Token *tok, const MacroMap &macros, const std::set<TokenString> &expandedmacros, const std::vector<const Token*> &parametertokens, bool expandResult=true) const {
+        const Token *expandHashHash(TokenList &output, const Location &loc, const Token *tok, const ExpandContext &ctx, const HideSet &expandedmacros, const std::vector<const Token*> &parametertokens, bool expandResult=true) const {
             Token *A = output.back();
             if (!A)
                 throw invalidHashHash(tok->location, name(), "Missing first argument");
@@ -2315,7 +4104,7 @@ namespace simplecpp {
             } else {
                 std::string strAB;
 
-                const bool varargs = variadic && !args.empty() && B->str() == args[args.size()-1U];
+                const bool varargs = variadic && !args.empty() && B->text() == args[args.size()-1U];
 
                 if (expandArg(tokensB, B, parametertokens)) {
                     if (tokensB.empty())
@@ -2342,34 +4131,35 @@ namespace simplecpp {
                         throw invalidHashHash::universalCharacterUB(tok->location, name(), A, strAB);
                 }
 
+                const InternedString textAB(strAB);
                 if (varargs && tokensB.empty() && tok->previous->str() == ",")
                     output.deleteToken(A);
-                else if (strAB != "," && macros.find(strAB) == macros.end()) {
-                    A->setstr(strAB);
+                else if (strAB != "," && findMacro(ctx, textAB) == ctx.macros.end()) {
+                    A->setstr(textAB);
                     for (Token *b = tokensB.front(); b; b = b->next)
                         b->location = loc;
                     output.takeTokens(tokensB);
                 } else if (sameline(B, nextTok) && sameline(B, nextTok->next) && nextTok->op == '#' && nextTok->next->op == '#') {
                     TokenList output2(files);
-                    output2.push_back(new Token(strAB, tok->location));
-                    nextTok = expandHashHash(output2, loc, nextTok, macros, expandedmacros, parametertokens);
+                    output2.push_back(new Token(textAB, tok->location));
+                    nextTok = expandHashHash(output2, loc, nextTok, ctx, expandedmacros, parametertokens);
                     output.deleteToken(A);
                     output.takeTokens(output2);
                 } else {
                     output.deleteToken(A);
                     TokenList tokens(files);
-                    tokens.push_back(new Token(strAB, tok->location));
+                    tokens.push_back(new Token(textAB, tok->location));
                     // for function like macros, push the (...)
                     if (tokensB.empty() && sameline(B,B->next) && B->next->op=='(') {
-                        const MacroMap::const_iterator it = macros.find(strAB);
-                        if (it != macros.end() && expandedmacros.find(strAB) == expandedmacros.end() && it->second.functionLike()) {
-                            const Token * const tok2 = appendTokens(tokens, loc, B->next, macros, expandedmacros, parametertokens);
+                        const MacroMap::const_iterator it = findMacro(ctx, textAB);
+                        if (it != ctx.macros.end() && !expandedmacros.contains(textAB) && it->second.functionLike()) {
+                            const Token * const tok2 = appendTokens(tokens, loc, B->next, ctx, expandedmacros, parametertokens);
                             if (tok2)
                                 nextTok = tok2->next;
                         }
                     }
                     if (expandResult)
-                        expandToken(output, loc, tokens.cfront(), macros, expandedmacros, parametertokens);
+                        expandToken(output, loc, tokens.cfront(), ctx, expandedmacros, parametertokens);
                     else
                         output.takeTokens(tokens);
                     for (Token *b = tokensB.front(); b; b = b->next)
@@ -2381,26 +4171,21 @@ namespace simplecpp {
             return nextTok;
         }
 
-        static bool isReplaced(const std::set<std::string> &expandedmacros) {
-            // return true if size > 1
-            auto it = expandedmacros.cbegin();
-            if (it == expandedmacros.cend())
-                return false;
-            ++it;
-            return (it != expandedmacros.cend());
+        static bool isReplaced(const HideSet &expandedmacros) {
+            return expandedmacros.size() > 1U;
         }
 
         /** name token in definition */
         const Token *nameTokDef;
 
         /** arguments for macro */
-        std::vector<TokenString> args;
+        mutable std::vector<InternedString> args;
 
         /** first token in replacement string */
-        const Token *valueToken;
+        mutable const Token *valueToken;
 
         /** token after replacement string */
-        const Token *endToken;
+        mutable const Token *endToken;
 
         /** files */
         std::vector<std::string> &files;
@@ -2412,17 +4197,20 @@ namespace simplecpp {
         mutable std::list<Location> usageList;
 
         /** is macro variadic? */
-        bool variadic;
+        mutable bool variadic;
 
         /** does the macro expansion have __VA_OPT__? */
-        bool variadicOpt;
+        mutable bool variadicOpt;
 
         /** Expansion value for varadic macros with __VA_OPT__ expanded and discarded respectively */
-        const TokenList *optExpandValue{};
-        const TokenList *optNoExpandValue{};
+        mutable std::unique_ptr<const TokenList> optExpandValue;
+        mutable std::unique_ptr<const TokenList> optNoExpandValue;
 
         /** was the value of this macro actually defined in the code? */
         bool valueDefinedInCode_;
+
+        /** is the body still to be parsed? */
+        mutable bool deferred;
     };
 }
 
@@ -2640,7 +4428,7 @@ static void simplifyHasInclude(simplecpp::TokenList &expr, const simplecpp::DUI
         return;
 
     for (simplecpp::Token *tok = expr.front(); tok; tok = tok->next) {
-        if (tok->str() != HAS_INCLUDE)
+        if (tok->keyword() != simplecpp::KwHasInclude)
             continue;
         const simplecpp::Token *tok1 = tok->next;
         if (!tok1) {
@@ -2697,17 +4485,26 @@ static void simplifyName(simplecpp::TokenList &expr)
 {
     for (simplecpp::Token *tok = expr.front(); tok; tok = tok->next) {
         if (tok->name) {
-            static const std::set<std::string> altop{"and","or","bitand","bitor","compl","not","not_eq","xor"};
-            if (altop.find(tok->str()) != altop.end()) {
-                bool alt;
-                if (tok->str() == "not" || tok->str() == "compl") {
-                    alt = isAlternativeUnaryOp(tok,tok->str());
-                } else {
-                    alt = isAlternativeBinaryOp(tok,tok->str());
-                }
-                if (alt)
-                    continue;
+            bool alt;
+            switch (tok->keyword()) {
+            case simplecpp::KwNot:
+            case simplecpp::KwCompl:
+                alt = isAlternativeUnaryOp(tok,tok->str());
+                break;
+            case simplecpp::KwAnd:
+            case simplecpp::KwBitand:
+            case simplecpp::KwBitor:
+            case simplecpp::KwNotEq:
+            case simplecpp::KwOr:
+            case simplecpp::KwXor:
+                alt = isAlternativeBinaryOp(tok,tok->str());
+                break;
+            default:
+                alt = false;
+                break;
             }
+            if (alt)
+                continue;
             if (tok->next && tok->next->str() == "(")
                 throw std::runtime_error("undefined function-like macro invocation: " + tok->str() + "( ... )");
             tok->setstr("0");
@@ -2976,6 +4773,19 @@ static long long evaluate(simplecpp::TokenList &expr, const simplecpp::DUI &dui,
     return expr.cfront() && expr.cfront() == expr.cback() && expr.cfront()->number ? stringToLL(expr.cfront()->str()) : 0LL;
 }
 
+/** are the parentheses from tok to the end of the line balanced */
+static bool balancedParentheses(const simplecpp::Token *tok)
+{
+    int par = 0;
+    for (const simplecpp::Token *tok2 = tok; sameline(tok, tok2); tok2 = tok2->next) {
+        if (tok2->op == '(')
+            ++par;
+        else if (tok2->op == ')')
+            --par;
+    }
+    return par == 0;
+}
+
 static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
 {
     const unsigned int line = tok->location.line;
@@ -2985,6 +4795,73 @@ static const simplecpp::Token *gotoNextLine(const simplecpp::Token *tok)
     return tok;
 }
 
+namespace {
+    /**
+     * The directives of a token list, in order. It is used to jump over
+     * false #if blocks without walking every line in them.
+     */
+    class DirectiveIndex {
+    public:
+        DirectiveIndex() = default;
+
+        explicit DirectiveIndex(const simplecpp::TokenList &tokens)
+            : mFront(tokens.cfront()), mBack(tokens.cback())
+        {
+            for (const simplecpp::Token *tok = tokens.cfront(); tok; tok = tok->next) {
+                if (tok->op == '#' && !sameline(tok->previousSkipComments(), tok)) {
+                    mPos.emplace(tok, mHashtoks.size());
+                    mHashtoks.push_back(tok);
+                }
+            }
+        }
+
+        /** are these the directives of tokens, the first and last token are compared to see if the list has been changed */
+        bool indexes(const simplecpp::TokenList &tokens) const {
+            return mFront && mFront == tokens.cfront() && mBack == tokens.cback();
+        }
+
+        /**
+         * Get the directive that is reached when the code after the directive
+         * that starts with hashtok is dropped line by line. next is nullptr
+         * when there are no more directives.
+         * @return false if hashtok is not indexed
+         */
+        bool nextDirective(const simplecpp::Token *hashtok, const simplecpp::Token *&next) const {
+            const auto it = mPos.find(hashtok);
+            if (it == mPos.end())
+                return false;
+            next = nullptr;
+            // dropping code line by line only stops at a '#' that starts a line
+            for (std::size_t i = it->second + 1U; i < mHashtoks.size(); ++i) {
+                if (!sameline(mHashtoks[i]->previous, mHashtoks[i])) {
+                    next = mHashtoks[i];
+                    break;
+                }
+            }
+            return true;
+        }
+
+    private:
+        const simplecpp::Token *mFront{};
+        const simplecpp::Token *mBack{};
+        std::vector<const simplecpp::Token *> mHashtoks;
+        std::unordered_map<const simplecpp::Token *, std::size_t> mPos;
+    };
+}
+
+struct simplecpp::FileDataCache::Directives {
+    /** the index of tokens, it is rebuilt when the tokens have been changed since they were indexed */
+    const DirectiveIndex &get(const TokenList &tokens) {
+        DirectiveIndex &index = mIndexes[&tokens];
+        if (!index.indexes(tokens))
+            index = DirectiveIndex(tokens);
+        return index;
+    }
+
+private:
+    std::unordered_map<const TokenList *, DirectiveIndex> mIndexes;
+};
+
 #ifdef SIMPLECPP_WINDOWS
 
 class NonExistingFilesCache {
@@ -3066,10 +4943,7 @@ std::pair<simplecpp::FileData *, bool> simplecpp::FileDataCache::tryload(FileDat
         return {id_it->second, false};
     }
 
-    auto *const data = new FileData {path, TokenList(path, filenames, outputList)};
-
-    if (dui.removeComments)
-        data->tokens.removeComments();
+    auto *const data = new FileData {path, TokenList(path, filenames, outputList, dui.removeComments)};
 
     name_it->second = data;
     mIdMap.emplace(fileId, data);
@@ -3199,9 +5073,6 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
         if (!filedata->tokens.front())
             continue;
 
-        if (dui.removeComments)
-            filedata->tokens.removeComments();
-
         filelist.emplace_back(filedata->tokens.front());
     }
 
@@ -3215,7 +5086,7 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
             continue;
 
         rawtok = rawtok->nextSkipComments();
-        if (!rawtok || rawtok->str() != INCLUDE)
+        if (!rawtok || rawtok->keyword() != KwInclude)
             continue;
 
         const std::string &sourcefile = rawtokens.file(rawtok->location);
@@ -3238,23 +5109,20 @@ simplecpp::FileDataCache simplecpp::load(const simplecpp::TokenList &rawtokens,
         if (!filedata->tokens.front())
             continue;
 
-        if (dui.removeComments)
-            filedata->tokens.removeComments();
-
         filelist.emplace_back(filedata->tokens.front());
     }
 
     return cache;
 }
 
-static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token *&tok1, simplecpp::MacroMap &macros, std::vector<std::string> &files, simplecpp::OutputList *outputList)
+static bool preprocessToken(simplecpp::TokenList &output, const simplecpp::Token *&tok1, simplecpp::MacroMap &macros, simplecpp::ExpansionCache *expansionCache, std::vector<std::string> &files, simplecpp::OutputList *outputList)
 {
     const simplecpp::Token * const tok = tok1;
-    const simplecpp::MacroMap::const_iterator it = tok->name ? macros.find(tok->str()) : macros.end();
+    const simplecpp::MacroMap::const_iterator it = tok->name ? macros.find(tok->text()) : macros.end();
     if (it != macros.end()) {
         simplecpp::TokenList value(files);
         try {
-            tok1 = it->second.expand(value, tok, macros, files);
+            tok1 = it->second.expand(value, tok, macros, expansionCache, files);
         } catch (const simplecpp::Macro::Error &err) {
             if (outputList) {
                 simplecpp::Output out{
@@ -3301,7 +5169,12 @@ static std::string getTimeDefine(const struct tm *timep)
     return std::string("\"").append(buf).append("\"");
 }
 
-void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+namespace simplecpp {
+    /** preprocess rawtokens, if stream is set the lines of rawtokens are lexed and released while they are preprocessed */
+    void preprocess(TokenList &output, const TokenList &rawtokens, TokenStream *stream, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond);
+}
+
+void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, simplecpp::TokenStream *stream, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
 {
 #ifdef SIMPLECPP_WINDOWS
     if (dui.clearIncludeCache)
@@ -3335,6 +5208,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
 
     const bool hasInclude = isCpp17OrLater(dui) || isGnu(dui);
     MacroMap macros;
+    ExpansionCache expansionCache;
     bool strictAnsiDefined = false;
     for (auto it = dui.defines.cbegin(); it != dui.defines.cend(); ++it) {
         const std::string &macrostr = *it;
@@ -3348,8 +5222,12 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
         const std::string lhs(macrostr.substr(0,eq));
         const std::string rhs(eq==std::string::npos ? std::string("1") : macrostr.substr(eq+1));
         try {
-            const Macro macro(lhs, rhs, dummy);
-            macros.insert(std::pair<TokenString,Macro>(macro.name(), macro));
+            Macro macro(lhs, rhs, dummy);
+            macros.emplace(macro.key(), std::move(macro));
+            if (stream && std::count(rhs.cbegin(), rhs.cend(), '(') != std::count(rhs.cbegin(), rhs.cend(), ')') && !stream->prepareAll()) {
+                output.clear();
+                return;
+            }
         } catch (const std::runtime_error& e) {
             if (outputList) {
                 simplecpp::Output err{
@@ -3366,22 +5244,22 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
 
     const bool strictAnsiUndefined = dui.undefined.find("__STRICT_ANSI__") != dui.undefined.cend();
     if (!isGnu(dui) && !strictAnsiDefined && !strictAnsiUndefined)
-        macros.insert(std::pair<TokenString, Macro>("__STRICT_ANSI__", Macro("__STRICT_ANSI__", "1", dummy)));
+        macros.emplace(InternedString("__STRICT_ANSI__"), Macro("__STRICT_ANSI__", "1", dummy));
 
-    macros.insert(std::make_pair("__FILE__", Macro("__FILE__", "__FILE__", dummy)));
-    macros.insert(std::make_pair("__LINE__", Macro("__LINE__", "__LINE__", dummy)));
-    macros.insert(std::make_pair("__COUNTER__", Macro("__COUNTER__", "__COUNTER__", dummy)));
+    macros.emplace(InternedString("__FILE__"), Macro("__FILE__", "__FILE__", dummy));
+    macros.emplace(InternedString("__LINE__"), Macro("__LINE__", "__LINE__", dummy));
+    macros.emplace(InternedString("__COUNTER__"), Macro("__COUNTER__", "__COUNTER__", dummy));
     struct tm ltime {};
     getLocaltime(ltime);
-    macros.insert(std::make_pair("__DATE__", Macro("__DATE__", getDateDefine(&ltime), dummy)));
-    macros.insert(std::make_pair("__TIME__", Macro("__TIME__", getTimeDefine(&ltime), dummy)));
+    macros.emplace(InternedString("__DATE__"), Macro("__DATE__", getDateDefine(&ltime), dummy));
+    macros.emplace(InternedString("__TIME__"), Macro("__TIME__", getTimeDefine(&ltime), dummy));
 
     if (!dui.std.empty()) {
         const cstd_t c_std = simplecpp::getCStd(dui.std);
         if (c_std != CUnknown) {
             const std::string std_def = simplecpp::getCStdString(c_std);
             if (!std_def.empty())
-                macros.insert(std::make_pair("__STDC_VERSION__", Macro("__STDC_VERSION__", std_def, dummy)));
+                macros.emplace(InternedString("__STDC_VERSION__"), Macro("__STDC_VERSION__", std_def, dummy));
         } else {
             const cppstd_t cpp_std = simplecpp::getCppStd(dui.std);
             if (cpp_std == CPPUnknown) {
@@ -3398,7 +5276,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
             }
             const std::string std_def = simplecpp::getCppStdString(cpp_std);
             if (!std_def.empty())
-                macros.insert(std::make_pair("__cplusplus", Macro("__cplusplus", std_def, dummy)));
+                macros.emplace(InternedString("__cplusplus"), Macro("__cplusplus", std_def, dummy));
         }
     }
 
@@ -3407,30 +5285,48 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
     // AlwaysFalse => drop all code in #if and #else
     enum IfState : std::uint8_t { True, ElseIsTrue, AlwaysFalse };
     std::stack<int> ifstates;
-    std::stack<const Token *> iftokens;
+    std::vector<const Token *> iftokens;
     ifstates.push(True);
 
-    std::stack<const Token *> includetokenstack;
+    // where to continue and the token list that is continued
+    std::stack<std::pair<const Token *, const TokenList *>> includetokenstack;
+    const TokenList *rawlist = nullptr;
+
+    // directives of rawtokens, indexed when a false #if block is first dropped.
+    // The cache keeps the index of an included file for later calls.
+    DirectiveIndex directives;
 
     std::set<std::string> pragmaOnce;
 
-    includetokenstack.push(rawtokens.cfront());
+    // a stream is lexed while it is preprocessed so it can't be indexed
+    includetokenstack.emplace(rawtokens.cfront(), stream ? nullptr : &rawtokens);
     for (auto it = dui.includes.cbegin(); it != dui.includes.cend(); ++it) {
         const FileData *const filedata = cache.get("", *it, dui, false, files, outputList).first;
         if (filedata != nullptr && filedata->tokens.cfront() != nullptr)
-            includetokenstack.push(filedata->tokens.cfront());
+            includetokenstack.emplace(filedata->tokens.cfront(), &filedata->tokens);
     }
 
     std::map<std::string, std::list<Location>> maybeUsedMacros;
 
     for (const Token *rawtok = nullptr; rawtok || !includetokenstack.empty();) {
         if (rawtok == nullptr) {
-            rawtok = includetokenstack.top();
+            rawtok = includetokenstack.top().first;
+            rawlist = includetokenstack.top().second;
             includetokenstack.pop();
             continue;
         }
 
+        // the top sourcefile is at the bottom of includetokenstack
+        if (stream && includetokenstack.empty() && !sameline(rawtok->previous, rawtok)) {
+            stream->release(rawtok, iftokens);
+            if (!stream->prepare(rawtok)) {
+                output.clear();
+                return;
+            }
+        }
+
         if (rawtok->op == '#' && !sameline(rawtok->previousSkipComments(), rawtok)) {
+            const Token * const hashtok = rawtok;
             if (!sameline(rawtok, rawtok->next)) {
                 rawtok = rawtok->next;
                 continue;
@@ -3441,7 +5337,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 continue;
             }
 
-            if (ifstates.size() <= 1U && (rawtok->str() == ELIF || rawtok->str() == ELSE || rawtok->str() == ENDIF)) {
+            if (ifstates.size() <= 1U && (rawtok->keyword() == KwElif || rawtok->keyword() == KwElse || rawtok->keyword() == KwEndif)) {
                 if (outputList) {
                     simplecpp::Output err{
                         Output::SYNTAX_ERROR,
@@ -3454,7 +5350,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 return;
             }
 
-            if (ifstates.top() == True && (rawtok->str() == ERROR || rawtok->str() == WARNING)) {
+            if (ifstates.top() == True && (rawtok->keyword() == KwError || rawtok->keyword() == KwWarning)) {
                 if (outputList) {
                     std::string msg;
                     for (const Token *tok = rawtok->next; tok && sameline(rawtok,tok); tok = tok->next) {
@@ -3464,30 +5360,41 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     }
                     msg = '#' + rawtok->str() + ' ' + msg;
                     simplecpp::Output err{
-                        rawtok->str() == ERROR ? Output::ERROR : Output::WARNING,
+                        rawtok->keyword() == KwError ? Output::ERROR : Output::WARNING,
                         rawtok->location,
                         std::move(msg)
                     };
 
                     outputList->emplace_back(std::move(err));
                 }
-                if (rawtok->str() == ERROR) {
+                if (rawtok->keyword() == KwError) {
                     output.clear();
                     return;
                 }
             }
 
-            if (rawtok->str() == DEFINE) {
+            if (rawtok->keyword() == KwDefine) {
                 if (ifstates.top() != True)
                     continue;
                 try {
-                    const Macro &macro = Macro(rawtok->previous, files);
+                    Macro macro(rawtok->previous, files);
+                    if (stream) {
+                        if (includetokenstack.empty())
+                            macro.copyDefinition();
+                        // the arguments of a call that is opened in the
+                        // macro can be anywhere after it
+                        if (!balancedParentheses(rawtok) && !stream->prepareAll()) {
+                            output.clear();
+                            return;
+                        }
+                    }
                     if (dui.undefined.find(macro.name()) == dui.undefined.end()) {
-                        const MacroMap::iterator it = macros.find(macro.name());
+                        expansionCache.changed(macro.key());
+                        const MacroMap::iterator it = macros.find(macro.key());
                         if (it == macros.end())
-                            macros.insert(std::pair<TokenString, Macro>(macro.name(), macro));
+                            macros.emplace(macro.key(), std::move(macro));
                         else
-                            it->second = macro;
+                            it->second = std::move(macro);
                     }
                 } catch (const std::runtime_error &) {
                     if (outputList) {
@@ -3512,7 +5419,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     output.clear();
                     return;
                 }
-            } else if (ifstates.top() == True && rawtok->str() == INCLUDE) {
+            } else if (ifstates.top() == True && rawtok->keyword() == KwInclude) {
                 TokenList inc1(files);
                 for (const Token *inctok = rawtok->next; sameline(rawtok,inctok); inctok = inctok->next) {
                     if (!inctok->comment)
@@ -3521,7 +5428,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 TokenList inc2(files);
                 if (!inc1.empty() && inc1.cfront()->name) {
                     const Token *inctok = inc1.cfront();
-                    if (!preprocessToken(inc2, inctok, macros, files, outputList)) {
+                    if (!preprocessToken(inc2, inctok, macros, &expansionCache, files, outputList)) {
                         output.clear();
                         return;
                     }
@@ -3578,11 +5485,12 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         outputList->emplace_back(std::move(out));
                     }
                 } else if (pragmaOnce.find(filedata->filename) == pragmaOnce.end()) {
-                    includetokenstack.push(gotoNextLine(rawtok));
+                    includetokenstack.emplace(gotoNextLine(rawtok), rawlist);
                     rawtok = filedata->tokens.cfront();
+                    rawlist = &filedata->tokens;
                     continue;
                 }
-            } else if (rawtok->str() == IF || rawtok->str() == IFDEF || rawtok->str() == IFNDEF || rawtok->str() == ELIF) {
+            } else if (rawtok->keyword() == KwIf || rawtok->keyword() == KwIfdef || rawtok->keyword() == KwIfndef || rawtok->keyword() == KwElif) {
                 if (!sameline(rawtok,rawtok->next)) {
                     if (outputList) {
                         simplecpp::Output out{
@@ -3597,15 +5505,15 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                 }
 
                 bool conditionIsTrue;
-                if (ifstates.top() == AlwaysFalse || (ifstates.top() == ElseIsTrue && rawtok->str() != ELIF))
+                if (ifstates.top() == AlwaysFalse || (ifstates.top() == ElseIsTrue && rawtok->keyword() != KwElif))
                     conditionIsTrue = false;
-                else if (rawtok->str() == IFDEF) {
-                    conditionIsTrue = (macros.find(rawtok->next->str()) != macros.end() || (hasInclude && rawtok->next->str() == HAS_INCLUDE));
+                else if (rawtok->keyword() == KwIfdef) {
+                    conditionIsTrue = (macros.find(rawtok->next->text()) != macros.end() || (hasInclude && rawtok->next->keyword() == KwHasInclude));
                     maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
-                } else if (rawtok->str() == IFNDEF) {
-                    conditionIsTrue = (macros.find(rawtok->next->str()) == macros.end() && !(hasInclude && rawtok->next->str() == HAS_INCLUDE));
+                } else if (rawtok->keyword() == KwIfndef) {
+                    conditionIsTrue = (macros.find(rawtok->next->text()) == macros.end() && !(hasInclude && rawtok->next->keyword() == KwHasInclude));
                     maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
-                } else { /*if (rawtok->str() == IF || rawtok->str() == ELIF)*/
+                } else { /*if (rawtok->keyword() == KwIf || rawtok->keyword() == KwElif)*/
                     TokenList expr(files);
                     for (const Token *tok = rawtok->next; tok && tok->location.sameline(rawtok->location); tok = tok->next) {
                         if (!tok->name) {
@@ -3613,16 +5521,16 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             continue;
                         }
 
-                        if (tok->str() == DEFINED) {
+                        if (tok->keyword() == KwDefined) {
                             tok = tok->next;
                             const bool par = (tok && tok->op == '(');
                             if (par)
                                 tok = tok->next;
                             maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
                             if (tok) {
-                                if (macros.find(tok->str()) != macros.end())
+                                if (macros.find(tok->text()) != macros.end())
                                     expr.push_back(new Token("1", tok->location));
-                                else if (hasInclude && tok->str() == HAS_INCLUDE)
+                                else if (hasInclude && tok->keyword() == KwHasInclude)
                                     expr.push_back(new Token("1", tok->location));
                                 else
                                     expr.push_back(new Token("0", tok->location));
@@ -3634,7 +5542,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     Output out{
                                         Output::SYNTAX_ERROR,
                                         rawtok->location,
-                                        "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition"
+                                        "failed to evaluate " + std::string(rawtok->keyword() == KwIf ? "#if" : "#elif") + " condition"
                                     };
                                     outputList->emplace_back(std::move(out));
                                 }
@@ -3644,7 +5552,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                             continue;
                         }
 
-                        if (hasInclude && tok->str() == HAS_INCLUDE) {
+                        if (hasInclude && tok->keyword() == KwHasInclude) {
                             tok = tok->next;
                             const bool par = (tok && tok->op == '(');
                             if (par)
@@ -3677,7 +5585,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                                     Output out{
                                         Output::SYNTAX_ERROR,
                                         rawtok->location,
-                                        "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition"
+                                        "failed to evaluate " + std::string(rawtok->keyword() == KwIf ? "#if" : "#elif") + " condition"
                                     };
                                     outputList->emplace_back(std::move(out));
                                 }
@@ -3690,7 +5598,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         maybeUsedMacros[rawtok->next->str()].emplace_back(rawtok->next->location);
 
                         const Token *tmp = tok;
-                        if (!preprocessToken(expr, tmp, macros, files, outputList)) {
+                        if (!preprocessToken(expr, tmp, macros, &expansionCache, files, outputList)) {
                             output.clear();
                             return;
                         }
@@ -3712,7 +5620,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                         }
                     } catch (const std::runtime_error &e) {
                         if (outputList) {
-                            std::string msg = "failed to evaluate " + std::string(rawtok->str() == IF ? "#if" : "#elif") + " condition";
+                            std::string msg = "failed to evaluate " + std::string(rawtok->keyword() == KwIf ? "#if" : "#elif") + " condition";
                             if (e.what() && *e.what())
                                 msg += std::string(", ") + e.what();
                             Output out{
@@ -3727,44 +5635,55 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
                     }
                 }
 
-                if (rawtok->str() != ELIF) {
+                if (rawtok->keyword() != KwElif) {
                     // push a new ifstate..
                     if (ifstates.top() != True)
                         ifstates.push(AlwaysFalse);
                     else
                         ifstates.push(conditionIsTrue ? True : ElseIsTrue);
-                    iftokens.push(rawtok);
+                    iftokens.push_back(rawtok);
                 } else {
                     if (ifstates.top() == True)
                         ifstates.top() = AlwaysFalse;
                     else if (ifstates.top() == ElseIsTrue && conditionIsTrue)
                         ifstates.top() = True;
-                    iftokens.top()->nextcond = rawtok;
-                    iftokens.top() = rawtok;
+                    iftokens.back()->nextcond = rawtok;
+                    iftokens.back() = rawtok;
                 }
-            } else if (rawtok->str() == ELSE) {
+            } else if (rawtok->keyword() == KwElse) {
                 ifstates.top() = (ifstates.top() == ElseIsTrue) ? True : AlwaysFalse;
-                iftokens.top()->nextcond = rawtok;
-                iftokens.top() = rawtok;
-            } else if (rawtok->str() == ENDIF) {
+                iftokens.back()->nextcond = rawtok;
+                iftokens.back() = rawtok;
+            } else if (rawtok->keyword() == KwEndif) {
                 ifstates.pop();
-                iftokens.top()->nextcond = rawtok;
-                iftokens.pop();
-            } else if (rawtok->str() == UNDEF) {
+                iftokens.back()->nextcond = rawtok;
+                iftokens.pop_back();
+            } else if (rawtok->keyword() == KwUndef) {
                 if (ifstates.top() == True) {
                     const Token *tok = rawtok->next;
                     while (sameline(rawtok,tok) && tok->comment)
                         tok = tok->next;
-                    if (sameline(rawtok, tok))
-                        macros.erase(tok->str());
+                    if (sameline(rawtok, tok)) {
+                        expansionCache.changed(tok->text());
+                        macros.erase(tok->text());
+                    }
                 }
-            } else if (ifstates.top() == True && rawtok->str() == PRAGMA && rawtok->next && rawtok->next->str() == ONCE && sameline(rawtok,rawtok->next)) {
+            } else if (ifstates.top() == True && rawtok->keyword() == KwPragma && rawtok->next && rawtok->next->keyword() == KwOnce && sameline(rawtok,rawtok->next)) {
                 pragmaOnce.insert(rawtokens.file(rawtok->location));
             }
-            if (ifstates.top() != True && rawtok->nextcond)
+            if (ifstates.top() != True && rawtok->nextcond) {
                 rawtok = rawtok->nextcond->previous;
-            else
+            } else if (ifstates.top() != True && rawlist && sameline(rawtok, hashtok)) {
+                if (rawlist == &rawtokens && !directives.indexes(rawtokens))
+                    directives = DirectiveIndex(rawtokens);
+                if (rawlist != &rawtokens && !cache.mDirectives)
+                    cache.mDirectives = std::make_shared<FileDataCache::Directives>();
+                const DirectiveIndex &index = (rawlist == &rawtokens) ? directives : cache.mDirectives->get(*rawlist);
+                if (!index.nextDirective(hashtok, rawtok))
+                    rawtok = gotoNextLine(rawtok);
+            } else {
                 rawtok = gotoNextLine(rawtok);
+            }
             continue;
         }
 
@@ -3774,6 +5693,19 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
             continue;
         }
 
+        // a run of tokens that are not expanded is copied straight into the
+        // output, the copies share their text with the raw tokens
+        if (rawtok->op != '#' && !(rawtok->name && macros.find(rawtok->text()) != macros.end())) {
+            const Token *tok = rawtok;
+            do {
+                if (!tok->comment)
+                    output.push_back(new Token(*tok));
+                tok = tok->next;
+            } while (tok && tok->op != '#' && sameline(tok->previous, tok) && !(tok->name && macros.find(tok->text()) != macros.end()));
+            rawtok = tok;
+            continue;
+        }
+
         bool hash=false, hashhash=false;
         if (rawtok->op == '#' && sameline(rawtok,rawtok->next)) {
             if (rawtok->next->op != '#') {
@@ -3788,7 +5720,7 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
         const Location loc(rawtok->location);
         TokenList tokens(files);
 
-        if (!preprocessToken(tokens, rawtok, macros, files, outputList)) {
+        if (!preprocessToken(tokens, rawtok, macros, &expansionCache, files, outputList)) {
             output.clear();
             return;
         }
@@ -3825,6 +5757,31 @@ void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenL
     }
 }
 
+void simplecpp::preprocess(simplecpp::TokenList &output, const simplecpp::TokenList &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+{
+    preprocess(output, rawtokens, nullptr, files, cache, dui, outputList, macroUsage, ifCond);
+}
+
+void simplecpp::preprocess(simplecpp::TokenList &output, simplecpp::TokenStream &rawtokens, std::vector<std::string> &files, simplecpp::FileDataCache &cache, const simplecpp::DUI &dui, simplecpp::OutputList *outputList, std::list<simplecpp::MacroUsage> *macroUsage, std::list<simplecpp::IfCond> *ifCond)
+{
+    // the lexer reports its messages before those of the preprocessor, and
+    // a file that can't be lexed is not preprocessed
+    OutputList preprocessOutput;
+    const std::size_t macroUsageSize = macroUsage ? macroUsage->size() : 0;
+    const std::size_t ifCondSize = ifCond ? ifCond->size() : 0;
+    preprocess(output, rawtokens.tokens(), &rawtokens, files, cache, dui, outputList ? &preprocessOutput : nullptr, macroUsage, ifCond);
+    if (!rawtokens.prepareAll()) {
+        output.clear();
+        preprocessOutput.clear();
+        while (macroUsage && macroUsage->size() > macroUsageSize)
+            macroUsage->pop_back();
+        while (ifCond && ifCond->size() > ifCondSize)
+            ifCond->pop_back();
+    }
+    if (outputList)
+        outputList->splice(outputList->end(), preprocessOutput);
+}
+
 void simplecpp::cleanup(FileDataCache &cache)
 {
     cache.clear();
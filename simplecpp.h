@@ -6,7 +6,9 @@
 #ifndef simplecppH
 #define simplecppH
 
+#include <atomic>
 #include <cctype>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <iosfwd>
@@ -112,6 +114,169 @@ namespace simplecpp {
 #endif // defined(__cpp_lib_string_view) && !defined(__cpp_lib_span)
 
     class Macro;
+    class TokenStream;
+
+    /** Names with a special meaning to the preprocessor */
+    enum keyword_t : std::uint8_t {
+        KwNone,
+        // directives
+        KwDefine, KwUndef, KwInclude, KwError, KwWarning, KwIf, KwIfdef, KwIfndef, KwElse, KwElif, KwEndif, KwPragma,
+        // operators and pragma arguments
+        KwDefined, KwHasInclude, KwOnce,
+        // builtin macros
+        KwFile, KwLine, KwCounter,
+        // alternative operator spellings
+        KwAnd, KwBitand, KwBitor, KwCompl, KwNot, KwNotEq, KwOr, KwXor
+    };
+
+    /**
+     * Interned token text. Equal strings share one entry, so copying only
+     * updates a reference count and comparing two InternedStrings compares
+     * pointers. The entry is freed when the last reference goes away.
+     * It has the const members of std::string that read the text, and it
+     * converts to const std::string &.
+     */
+    class SIMPLECPP_LIB InternedString {
+    public:
+        InternedString() = default;
+        explicit InternedString(const std::string &s);
+        InternedString(const InternedString &other) : mEntry(other.mEntry) {
+            if (mEntry)
+                mEntry->refs.fetch_add(1U, std::memory_order_relaxed);
+        }
+        InternedString(InternedString &&other) noexcept : mEntry(other.mEntry) {
+            other.mEntry = nullptr;
+        }
+        ~InternedString() {
+            if (mEntry)
+                release();
+        }
+        InternedString &operator=(InternedString other) noexcept {
+            std::swap(mEntry, other.mEntry);
+            return *this;
+        }
+        InternedString &operator=(const std::string &s) {
+            return *this = InternedString(s);
+        }
+
+        const std::string &str() const {
+            return mEntry ? mEntry->str : emptyString();
+        }
+        operator const std::string &() const {
+            return str();
+        }
+        bool empty() const {
+            return !mEntry;
+        }
+        std::size_t size() const {
+            return str().size();
+        }
+        std::size_t length() const {
+            return str().size();
+        }
+        const char *c_str() const {
+            return str().c_str();
+        }
+        const char *data() const {
+            return str().data();
+        }
+        const char &operator[](std::size_t pos) const {
+            return str()[pos];
+        }
+        std::string::const_iterator begin() const {
+            return str().begin();
+        }
+        std::string::const_iterator end() const {
+            return str().end();
+        }
+        std::size_t find(const std::string &s, std::size_t pos = 0) const {
+            return str().find(s, pos);
+        }
+        std::size_t find(char c, std::size_t pos = 0) const {
+            return str().find(c, pos);
+        }
+        std::string substr(std::size_t pos = 0, std::size_t n = std::string::npos) const {
+            return str().substr(pos, n);
+        }
+        int compare(const std::string &s) const {
+            return str().compare(s);
+        }
+        /** precomputed std::hash of the string */
+        std::size_t hash() const {
+            return mEntry ? mEntry->hash : 0U;
+        }
+        /** the keyword the string spells, classified once when it is interned */
+        keyword_t keyword() const {
+            return mEntry ? mEntry->keyword : KwNone;
+        }
+
+        bool operator==(const InternedString &other) const {
+            return mEntry == other.mEntry;
+        }
+        bool operator!=(const InternedString &other) const {
+            return mEntry != other.mEntry;
+        }
+        bool operator==(const std::string &s) const {
+            return str() == s;
+        }
+        bool operator!=(const std::string &s) const {
+            return str() != s;
+        }
+        bool operator==(const char *s) const {
+            return str() == s;
+        }
+        bool operator!=(const char *s) const {
+            return str() != s;
+        }
+
+        struct Hash {
+            std::size_t operator()(const InternedString &s) const {
+                return s.hash();
+            }
+        };
+
+    private:
+        struct Entry {
+            Entry(const std::string &s, std::size_t h, keyword_t k) : str(s), hash(h), keyword(k), refs(1U) {}
+            const std::string str;
+            const std::size_t hash;
+            const keyword_t keyword;
+            std::atomic<unsigned int> refs;
+        };
+        struct Table;
+
+        static Table &table();
+        static const std::string &emptyString();
+        void release();
+
+        Entry *mEntry{};
+    };
+
+    inline bool operator==(const std::string &s, const InternedString &i) {
+        return i == s;
+    }
+    inline bool operator!=(const std::string &s, const InternedString &i) {
+        return i != s;
+    }
+    inline bool operator==(const char *s, const InternedString &i) {
+        return i == s;
+    }
+    inline bool operator!=(const char *s, const InternedString &i) {
+        return i != s;
+    }
+    inline std::string operator+(const std::string &s, const InternedString &i) {
+        return s + i.str();
+    }
+    inline std::string operator+(const InternedString &i, const std::string &s) {
+        return i.str() + s;
+    }
+    inline std::string operator+(const char *s, const InternedString &i) {
+        return s + i.str();
+    }
+    inline std::string operator+(const InternedString &i, const char *s) {
+        return i.str() + s;
+    }
+    SIMPLECPP_LIB std::ostream &operator<<(std::ostream &os, const InternedString &s);
 
     /**
      * Location in source code
@@ -158,18 +323,48 @@ namespace simplecpp {
             flags();
         }
 
+        Token(const InternedString &s, const Location &loc, bool wsahead = false) :
+            whitespaceahead(wsahead), location(loc), string(s) {
+            flags();
+        }
+
         Token(const Token &tok) :
-            macro(tok.macro), op(tok.op), comment(tok.comment), name(tok.name), number(tok.number), whitespaceahead(tok.whitespaceahead), location(tok.location), string(tok.string), mExpandedFrom(tok.mExpandedFrom) {}
+            macro(tok.macro), op(tok.op), comment(tok.comment), name(tok.name), number(tok.number), whitespaceahead(tok.whitespaceahead), location(tok.location), string(tok.string), mExpandedFrom(tok.mExpandedFrom) {
+            if (mExpandedFrom)
+                mExpandedFrom->refs.fetch_add(1U, std::memory_order_relaxed);
+        }
+
+        ~Token() {
+            if (mExpandedFrom)
+                Expansion::release(mExpandedFrom);
+        }
 
         Token &operator=(const Token &tok) = delete;
 
+        /** deleted tokens are kept for reuse, in a free list per thread and a bounded shared pool */
+        static void *operator new(std::size_t size);
+        static void operator delete(void *p, std::size_t size);
+        /** number of deleted tokens kept for reuse by the pool and this thread, at most 16384 + 511 */
+        static std::size_t freeTokens();
+
         const TokenString& str() const {
+            return string.str();
+        }
+        /** the interned text, copying it does not copy the string */
+        const InternedString &text() const {
             return string;
         }
+        keyword_t keyword() const {
+            return string.keyword();
+        }
         void setstr(const std::string &s) {
             string = s;
             flags();
         }
+        void setstr(const InternedString &s) {
+            string = s;
+            flags();
+        }
 
         bool isOneOf(const char ops[]) const;
         bool startsWithOneOf(const char c[]) const;
@@ -179,12 +374,19 @@ namespace simplecpp {
                    (str.size() > 1U && (str[0] == '-' || str[0] == '+') && std::isdigit(static_cast<unsigned char>(str[1])));
         }
 
-        TokenString macro;
+        /** name of the macro the token was expanded from, it reads like the std::string it used to be */
+        InternedString macro;
         char op;
         bool comment;
         bool name;
         bool number;
         bool whitespaceahead;
+    private:
+        friend class TokenList;
+        friend class TokenStream;
+        /** the lexer skipped a comment after this token, it is kept apart from the next token */
+        bool mCommentAhead{};
+    public:
         Location location;
         Token *previous{};
         Token *next{};
@@ -205,29 +407,58 @@ namespace simplecpp {
         }
 
         void setExpandedFrom(const Token *tok, const Macro* m) {
-            mExpandedFrom = tok->mExpandedFrom;
-            mExpandedFrom.insert(m);
+            const Expansion * const old = mExpandedFrom;
+            if (tok->isExpandedFrom(m)) {
+                mExpandedFrom = tok->mExpandedFrom;
+                mExpandedFrom->refs.fetch_add(1U, std::memory_order_relaxed);
+            } else {
+                mExpandedFrom = new Expansion(m, tok->mExpandedFrom);
+            }
+            if (old)
+                Expansion::release(old);
             if (tok->whitespaceahead)
                 whitespaceahead = true;
         }
         bool isExpandedFrom(const Macro* m) const {
-            return mExpandedFrom.find(m) != mExpandedFrom.end();
+            for (const Expansion *e = mExpandedFrom; e; e = e->parent) {
+                if (e->macro == m)
+                    return true;
+            }
+            return false;
         }
 
         void printAll() const;
         void printOut() const;
     private:
         void flags() {
-            name = (std::isalpha(static_cast<unsigned char>(string[0])) || string[0] == '_' || string[0] == '$')
-                   && (std::memchr(string.c_str(), '\'', string.size()) == nullptr);
-            comment = string.size() > 1U && string[0] == '/' && (string[1] == '/' || string[1] == '*');
-            number = isNumberLike(string);
-            op = (string.size() == 1U && !name && !comment && !number) ? string[0] : '\0';
+            const std::string &s = string.str();
+            name = (std::isalpha(static_cast<unsigned char>(s[0])) || s[0] == '_' || s[0] == '$')
+                   && (std::memchr(s.c_str(), '\'', s.size()) == nullptr);
+            comment = s.size() > 1U && s[0] == '/' && (s[1] == '/' || s[1] == '*');
+            number = isNumberLike(s);
+            op = (s.size() == 1U && !name && !comment && !number) ? s[0] : '\0';
         }
 
-        TokenString string;
+        InternedString string;
+
+        /**
+         * A macro the token has been expanded from and the record of the
+         * token it was expanded from. The records are shared by the tokens
+         * of an expansion and freed with the last token that refers to them.
+         */
+        struct Expansion {
+            Expansion(const Macro *m, const Expansion *p) : macro(m), parent(p), refs(1U) {
+                if (parent)
+                    parent->refs.fetch_add(1U, std::memory_order_relaxed);
+            }
+            static void release(const Expansion *e);
+
+            const Macro * const macro;
+            const Expansion * const parent;
+            mutable std::atomic<unsigned int> refs;
+        };
 
-        std::set<const Macro*> mExpandedFrom;
+        const Expansion *mExpandedFrom{};
     };
 
     /** Output from preprocessor */
@@ -257,8 +488,8 @@ namespace simplecpp {
         class Stream;
 
         explicit TokenList(std::vector<std::string> &filenames);
-        /** generates a token list from the given std::istream parameter */
-        TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr);
+        /** generates a token list from the given std::istream parameter, comments are removed while lexing if skipComments is set */
+        TokenList(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, bool skipComments = false);
         /** generates a token list from the given buffer */
         template<size_t size>
         TokenList(const char (&data)[size], std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr)
@@ -295,8 +526,17 @@ namespace simplecpp {
         {}
 #endif // __cpp_lib_span
 
-        /** generates a token list from the given filename parameter */
-        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr);
+        /**
+         * generates a token list from the given filename parameter, comments are removed while lexing if skipComments is set.
+         * A large file is split at line boundaries and the parts are lexed on up to threads threads.
+         */
+        TokenList(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr, bool skipComments = false, unsigned int threads = 1);
+        /**
+         * A copy shares the tokens of other until one of the lists is changed,
+         * the list that is changed first gets its own copy of the tokens then.
+         * Token pointers that were taken from a list before it was copied must
+         * not be used to change it.
+         */
         TokenList(const TokenList &other);
         TokenList(TokenList &&other);
         ~TokenList();
@@ -312,7 +552,7 @@ namespace simplecpp {
         void dump(bool linenrs = false) const;
         std::string stringify(bool linenrs = false) const;
 
-        void readfile(Stream &stream, const std::string &filename=std::string(), OutputList *outputList = nullptr);
+        void readfile(Stream &stream, const std::string &filename=std::string(), OutputList *outputList = nullptr, bool skipComments = false);
         /**
          * @throws std::overflow_error thrown on overflow or division by zero
          * @throws std::runtime_error thrown on invalid expressions
@@ -322,6 +562,7 @@ namespace simplecpp {
         void removeComments();
 
         Token *front() {
+            unshare();
             return frontToken;
         }
 
@@ -330,6 +571,7 @@ namespace simplecpp {
         }
 
         Token *back() {
+            unshare();
             return backToken;
         }
 
@@ -340,6 +582,7 @@ namespace simplecpp {
         void deleteToken(Token *tok) {
             if (!tok)
                 return;
+            unshare();
             Token * const prev = tok->previous;
             Token * const next = tok->next;
             if (prev)
@@ -356,6 +599,8 @@ namespace simplecpp {
         void takeTokens(TokenList &other) {
             if (!other.frontToken)
                 return;
+            unshare();
+            other.unshare();
             if (!frontToken) {
                 frontToken = other.frontToken;
             } else {
@@ -378,7 +623,11 @@ namespace simplecpp {
     private:
         TokenList(const unsigned char* data, std::size_t size, std::vector<std::string> &filenames, const std::string &filename, OutputList *outputList, int unused);
 
-        void combineOperators();
+        /**
+         * combine tok with the tokens after it, the tokens before it have been combined already.
+         * frontCommentAhead tells if a comment was skipped before the first token.
+         */
+        void combineOperators(Token *tok, std::vector<bool> &executableScope, bool frontCommentAhead);
 
         void constFoldUnaryNotPosNeg(Token *tok);
         /**
@@ -395,17 +644,111 @@ namespace simplecpp {
          */
         void constFoldQuestionOp(Token *&tok1);
 
-        std::string readUntil(Stream &stream, const Location &location, char start, char end, OutputList *outputList);
+        friend class TokenStream;
+        struct LexState;
+
+        /** lexer, instantiated for the concrete stream types so the per-character calls can be inlined */
+        template<class StreamT>
+        void readStream(StreamT &stream, const std::string &filename, OutputList *outputList, bool skipComments);
+        /** lex until the stream ends or state.pauseLines more lines are final, returns true if it paused */
+        template<class StreamT>
+        bool readStream(StreamT &stream, LexState &state, OutputList *outputList);
+
+        /** lex the file buffer, in parts on up to threads threads when it is large */
+        void readBuffer(const unsigned char *data, std::size_t size, const std::string &filename, OutputList *outputList, bool skipComments, unsigned int threads);
+
+        template<class StreamT>
+        std::string readUntil(StreamT &stream, const Location &location, char start, char end, OutputList *outputList);
         void lineDirective(unsigned int fileIndex, unsigned int line, Location &location);
 
-        const Token* lastLineTok(int maxsize=1000) const;
-        const Token* isLastLinePreprocessor(int maxsize=1000) const;
+        /** first token on the last line that is not a comment */
+        const Token* lastLineTok() const;
 
         unsigned int fileIndex(const std::string &filename);
 
+        /** tokens that are shared by copies of a list */
+        struct Shared;
+        void share(const TokenList &other);
+        static void release(Shared *s);
+        /** give the list its own tokens before they are changed */
+        void unshare() {
+            if (shared.load(std::memory_order_relaxed))
+                copyShared();
+        }
+        void copyShared();
+
         Token *frontToken;
         Token *backToken;
         std::vector<std::string> &files;
+        /** the tokens are shared with copies of the list, nullptr when the list owns them alone */
+        mutable std::atomic<Shared *> shared{};
+        /** the owner keeps pointers to the tokens and changes them, copies of the list get their own tokens */
+        bool pinned{};
+    };
+
+    /**
+     * Raw tokens of a file that is lexed while it is preprocessed. Only a
+     * window of the tokens is kept in memory, preprocess() lexes more lines
+     * when it needs them and releases the lines it is done with. This is
+     * meant for very large generated source files. The bytes of a file are
+     * read into memory at once, they are much smaller than the tokens.
+     */
+    class SIMPLECPP_LIB TokenStream {
+    public:
+        /** reads the file and lexes it in chunks, comments are removed while lexing if skipComments is set */
+        TokenStream(const std::string &filename, std::vector<std::string> &filenames, OutputList *outputList = nullptr, bool skipComments = false);
+        /** lexes the std::istream in chunks, it must outlive the TokenStream */
+        TokenStream(std::istream &istr, std::vector<std::string> &filenames, const std::string &filename=std::string(), OutputList *outputList = nullptr, bool skipComments = false);
+        TokenStream(const TokenStream &other) = delete;
+        ~TokenStream();
+        TokenStream &operator=(const TokenStream &other) = delete;
+
+        /** the tokens that have been lexed and not released yet */
+        const TokenList &tokens() const {
+            return list;
+        }
+
+        /**
+         * Lex until the tokens that preprocessing the line at tok can look
+         * at are final: the macro calls that are started before the next
+         * line have their closing parenthesis and the next line is there.
+         * @return false if the file could not be lexed, the tokens have been cleared then
+         */
+        bool prepare(const Token *tok);
+
+        /** lex the rest of the file, returns false if the file could not be lexed */
+        bool prepareAll();
+
+        /** release the lines before tok, the tokens in keep are still referenced and are not deleted */
+        void release(const Token *tok, const std::vector<const Token *> &keep);
+
+    private:
+        void init(const std::string &filename, bool skipComments);
+        bool lexMore();
+        void updateReady();
+
+        TokenList list;
+        OutputList *outputList;
+        /** the file contents or the decoded UTF-16 input, the stream reads from it when buffered is set */
+        std::vector<unsigned char> buffer;
+        std::unique_ptr<TokenList::Stream> stream;
+        bool buffered{};
+        std::unique_ptr<TokenList::LexState> state;
+        /** the lexer has not reached the end of the stream */
+        bool more{};
+
+        /** first token that is not final, the tokens before it are never changed by the lexer */
+        Token *readyEnd{};
+        /** last token that has been checked for readyEnd and the parenthesis depth at it */
+        Token *readyScan{};
+        int readyDepth{};
+        int readyMinDepth{};
+
+        /** next line prepare() needs to look at, the lines before it have been prepared */
+        const Token *prepareTok{};
+
+        /** released tokens that are still referenced */
+        std::vector<Token *> detached;
     };
 
     /** Tracking how macros are used */
@@ -472,6 +815,7 @@ namespace simplecpp {
         void clear() {
             mNameMap.clear();
             mIdMap.clear();
+            mDirectives.reset();
             mData.clear();
         }
 
@@ -545,9 +889,14 @@ namespace simplecpp {
 
         std::pair<FileData *, bool> tryload(name_map_type::iterator &name_it, const DUI &dui, std::vector<std::string> &filenames, OutputList *outputList);
 
+        /** the directives of the cached files, preprocess() indexes them to jump over false #if blocks */
+        struct Directives;
+        friend void preprocess(TokenList &output, const TokenList &rawtokens, TokenStream *stream, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList, std::list<MacroUsage> *macroUsage, std::list<IfCond> *ifCond);
+
         container_type mData;
         name_map_type mNameMap;
         id_map_type mIdMap;
+        std::shared_ptr<Directives> mDirectives;
     };
 
     /** Converts character literal (including prefix, but not ud-suffix) to long long value.
@@ -596,6 +945,14 @@ namespace simplecpp {
      */
     SIMPLECPP_LIB void preprocess(TokenList &output, const TokenList &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList = nullptr, std::list<MacroUsage> *macroUsage = nullptr, std::list<IfCond> *ifCond = nullptr);
 
+    /**
+     * Preprocess a top sourcefile that is lexed while it is preprocessed,
+     * the lines of rawtokens are released once they have been preprocessed.
+     * The output is the same as for the TokenList overload, it is not
+     * streamed: output holds all the preprocessed tokens when this returns.
+     */
+    SIMPLECPP_LIB void preprocess(TokenList &output, TokenStream &rawtokens, std::vector<std::string> &files, FileDataCache &cache, const DUI &dui, OutputList *outputList = nullptr, std::list<MacroUsage> *macroUsage = nullptr, std::list<IfCond> *ifCond = nullptr);
+
     /**
      * Deallocate data
      */
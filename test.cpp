@@ -6,13 +6,17 @@
 #include "simplecpp.h"
 
 #include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -455,6 +459,23 @@ static void combineOperators_andequal()
     ASSERT_EQUALS("f ( x &= 2 ) ;", preprocess("f(x &= 2);"));
 }
 
+static void combineOperators_shift()
+{
+    ASSERT_EQUALS("x <<= 1 ;", preprocess("x <<= 1;"));
+    ASSERT_EQUALS("x >>= 1 ;", preprocess("x >>= 1;"));
+    ASSERT_EQUALS("x << = == 1 ;", preprocess("x <<= == 1;"));
+    ASSERT_EQUALS("x <<= y", preprocess("x << = y"));
+}
+
+static void combineOperators_adjacent()
+{
+    ASSERT_EQUALS("a -- > b ;", preprocess("a-->b;"));
+    ASSERT_EQUALS("1 - -> b ;", preprocess("1-->b;"));
+    ASSERT_EQUALS("a == = b ;", preprocess("a===b;"));
+    ASSERT_EQUALS("a ++ = b ;", preprocess("a++=b;"));
+    ASSERT_EQUALS("a :: :", preprocess("a:::"));
+}
+
 static void combineOperators_ellipsis()
 {
     ASSERT_EQUALS("void f ( int , ... ) ;", preprocess("void f(int, ...);"));
@@ -679,6 +700,60 @@ static void define13()
                   "}", preprocess(code));
 }
 
+static void define14()
+{
+    // the macro body is parsed when the macro is first expanded
+    const char code[] = "#define A(x) x+B\n"
+                        "#define B 1\n"
+                        "#define B 2\n"
+                        "A(B)\n"
+                        "A(3)";
+    ASSERT_EQUALS("\n\n\n2 + 2\n3 + 2", preprocess(code));
+}
+
+static void define15()
+{
+    // repeated calls are replayed at their own location, a #define of a
+    // name that the expansion looked up is seen by the next call
+    const char code[] = "#define A B\n"
+                        "#define F(x) x+A\n"
+                        "A F(1)\n"
+                        "A F(1)\n"
+                        "#define B 2\n"
+                        "A F(1)\n"
+                        "A F(1) F(__LINE__) F(__LINE__)\n"
+                        "A F(1) F(__COUNTER__) F(__COUNTER__)";
+    ASSERT_EQUALS("\n\nB 1 + B\n"
+                  "B 1 + B\n\n"
+                  "2 1 + 2\n"
+                  "2 1 + 2 7 + 2 7 + 2\n"
+                  "2 1 + 2 0 + 2 1 + 2", preprocess(code));
+}
+
+static void define16()
+{
+    // each expansion ends with the name of the next macro that is called
+    const char code[] = "#define A(x) x B\n"
+                        "#define B(x) x C\n"
+                        "#define C(x) g(x) A\n"
+                        "A(1)(2)(3)(4)";
+    ASSERT_EQUALS("\n\n\n1 2 g ( 3 ) A ( 4 )", preprocess(code));
+}
+
+static void define17()
+{
+    // the tokens of a call that spans several lines are at the location of the call
+    const char code[] = "#define F(x) x\n"
+                        "#define G(a,b) a+b\n"
+                        "F(G(1,\n"
+                        "2))\n"
+                        "F(\n"
+                        "__LINE__ G(\n"
+                        "3,\n"
+                        "4))";
+    ASSERT_EQUALS("\n\n1 + 2\n\n5 3 + 4", preprocess(code));
+}
+
 
 
 static void define_invalid_1()
@@ -1809,6 +1884,55 @@ static void ifndef()
     ASSERT_EQUALS("\n1", preprocess(code2));
 }
 
+static void ifFalseBlock()
+{
+    const char code[] = "#if 0\n"
+                        "a\n"
+                        "#if 1\n"
+                        "b\n"
+                        "#endif\n"
+                        "c /* # */\n"
+                        "/* */ #define X 1\n"
+                        "#elif 1\n"
+                        "X\n"
+                        "#endif\n"
+                        "#ifdef A\n"
+                        "#error\n"
+                        "#endif";
+    ASSERT_EQUALS("\n\n\n\n\n\n\n\nX", preprocess(code));
+}
+
+static void ifFalseBlockInclude()
+{
+    // the directives of a cached file are indexed once for all calls
+    std::vector<std::string> files;
+    simplecpp::FileDataCache cache;
+    cache.insert({"foo.h", makeTokenList("#if A\na\n#else\nb\n#endif\n#if !A\nc\n#endif\n", files, "foo.h")});
+    const simplecpp::TokenList rawtokens = makeTokenList("#include \"foo.h\"\n", files);
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(".");
+
+    simplecpp::TokenList tokens1(files);
+    dui.defines.emplace_back("A=1");
+    simplecpp::preprocess(tokens1, rawtokens, files, cache, dui);
+    ASSERT_EQUALS("\na", tokens1.stringify());
+
+    simplecpp::TokenList tokens2(files);
+    dui.defines.back() = "A=0";
+    simplecpp::preprocess(tokens2, rawtokens, files, cache, dui);
+    ASSERT_EQUALS("\n\n\nb\n\n\nc", tokens2.stringify());
+
+    // the file is indexed again when its tokens have been changed, the
+    // new tokens can be allocated where the deleted ones were
+    simplecpp::TokenList &tokens = (*cache.begin())->tokens;
+    tokens.clear();
+    simplecpp::TokenList changed = makeTokenList("#if A\nd\n#elif 1\ne\n#else\nf\n#endif\n#if !A\ng\n#endif\n", files, "foo.h");
+    tokens.takeTokens(changed);
+    simplecpp::TokenList tokens3(files);
+    simplecpp::preprocess(tokens3, rawtokens, files, cache, dui);
+    ASSERT_EQUALS("\n\n\ne\n\n\n\n\ng", tokens3.stringify());
+}
+
 static void ifA()
 {
     const char code[] = "#if A==1\n"
@@ -2173,6 +2297,36 @@ static void location11()
                   preprocess(code));
 }
 
+static void locationFiles()
+{
+    // file names are looked up in a hashed index while lexing
+    const char code[] = "#line 1 \"a.y\"\n"
+                        "a\n"
+                        "#line 1 \"b.y\"\n"
+                        "b\n"
+                        "#line 1 \"a.y\"\n"
+                        "c\n"
+                        "#line 1 \"main.c\"\n"
+                        "d\n";
+    std::vector<std::string> files;
+    files.emplace_back("x.h");
+    files.emplace_back("main.c");
+    const simplecpp::TokenList tokens = makeTokenList(code, files, "main.c");
+    ASSERT_EQUALS(4U, files.size());
+    ASSERT_EQUALS("a.y", files[2]);
+    ASSERT_EQUALS("b.y", files[3]);
+    const simplecpp::Token *tok = tokens.cfront();
+    while (tok && tok->str() != "a")
+        tok = tok->next;
+    ASSERT_EQUALS(2U, tok ? tok->location.fileIndex : 0U);
+    while (tok && tok->str() != "c")
+        tok = tok->next;
+    ASSERT_EQUALS(2U, tok ? tok->location.fileIndex : 0U);
+    while (tok && tok->str() != "d")
+        tok = tok->next;
+    ASSERT_EQUALS(1U, tok ? tok->location.fileIndex : 0U);
+}
+
 // TODO: test #file/#endfile
 
 static void missingHeader1()
@@ -2615,6 +2769,17 @@ static void include9()
     ASSERT_EQUALS("\n#line 2 \"1.h\"\nx = 1 ;", out.stringify());
 }
 
+static void include10() // #include of a directory
+{
+    const char code[] = "#include \"testsuite\"\n"
+                        "x\n";
+    simplecpp::DUI dui;
+    dui.includePaths.emplace_back(testSourceDir);
+    simplecpp::OutputList outputList;
+    ASSERT_EQUALS("\nx", preprocess(code, dui, &outputList));
+    ASSERT_EQUALS("", toString(outputList));
+}
+
 static void readfile_nullbyte()
 {
     const char code[] = "ab\0cd";
@@ -2770,6 +2935,252 @@ static void readfile_file_not_found()
     ASSERT_EQUALS("file0,0,file_not_found,File is missing: NotAFile\n", toString(outputList));
 }
 
+static void readfile_file()
+{
+    const std::string filename = testSourceDir + "/testsuite/realFileName1.cpp";
+    std::ifstream f(filename);
+    const std::string code((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+    std::vector<std::string> files;
+    simplecpp::OutputList outputList;
+    const simplecpp::TokenList tokens(filename, files, &outputList);
+    ASSERT_EQUALS("", toString(outputList));
+    ASSERT_EQUALS(makeTokenList(code.c_str(), files, filename).stringify(), tokens.stringify());
+}
+
+static void readfile_directory()
+{
+    simplecpp::OutputList outputList;
+    std::vector<std::string> files;
+    const simplecpp::TokenList tokens(testSourceDir + "/testsuite", files, &outputList);
+    ASSERT_EQUALS("", toString(outputList));
+    ASSERT_EQUALS("", tokens.stringify());
+}
+
+static std::string readfileSkipComments(const char code[])
+{
+    std::vector<std::string> files;
+    std::istringstream istr(code);
+    return simplecpp::TokenList(istr, files, std::string(), nullptr, true).stringify(true);
+}
+
+static std::string readfileRemoveComments(const char code[])
+{
+    std::vector<std::string> files;
+    simplecpp::TokenList tokens = makeTokenList(code, files);
+    tokens.removeComments();
+    return tokens.stringify(true);
+}
+
+static void readfile_skip_comments()
+{
+    const char code1[] = "// comment\n"
+                         "int a; /* multi\n"
+                         "line */ int b;\n"
+                         "#define A 1 /* in\n"
+                         "directive */ + 2\n"
+                         "#define B // line \\\n"
+                         "comment\n"
+                         "#include /**/ <a.h>\n"
+                         "x";
+    ASSERT_EQUALS(readfileRemoveComments(code1), readfileSkipComments(code1));
+    ASSERT_EQUALS("1: \n"
+                  "2: int a ;\n"
+                  "3: int b ;\n"
+                  "4: # define A 1 + 2\n"
+                  "5: \n"
+                  "6: # define B\n"
+                  "7: \n"
+                  "8: # include <a.h>\n"
+                  "9: x", readfileSkipComments(code1));
+
+    // a comment between backslash and newline prevents the line splicing
+    const char code2[] = "#define A \\ /**/\n"
+                         "1";
+    ASSERT_EQUALS(readfileRemoveComments(code2), readfileSkipComments(code2));
+
+    const char code3[] = "#line 10 // comment\n"
+                         "a\n"
+                         "#line 11\n"
+                         "/* comment */\n"
+                         "b";
+    ASSERT_EQUALS(readfileRemoveComments(code3), readfileSkipComments(code3));
+
+    const char code4[] = "#line 20 /* comment */ \"a.c\"\n"
+                         "x";
+    ASSERT_EQUALS(readfileRemoveComments(code4), readfileSkipComments(code4));
+    ASSERT_EQUALS("1: # line 20 \"a.c\"\n"
+                  "#line 20 \"a.c\"\n"
+                  "20: x", readfileSkipComments(code4));
+
+    // operators and float literals are not combined across a comment
+    const char code5[] = "x = 1. // comment\n"
+                         "5;\n"
+                         "y <<= /**/ =";
+    ASSERT_EQUALS(readfileRemoveComments(code5), readfileSkipComments(code5));
+    ASSERT_EQUALS("1: x = 1.\n"
+                  "2: 5 ;\n"
+                  "3: y <<= =", readfileSkipComments(code5));
+
+    const char code6[] = "a + /**/ +b; 1e /**/ +2; u8 /**/ \"s\";\n"
+                         "void f(int /**/ &= 1);\n"
+                         "/**/ { x &= 1; } y /**/ -- ;";
+    ASSERT_EQUALS(readfileRemoveComments(code6), readfileSkipComments(code6));
+}
+
+static void readfile_long_directive()
+{
+    // comments in directives are joined to one line also after many tokens
+    std::string code = "#define A";
+    for (int i = 0; i < 2000; ++i)
+        code += " 1";
+    code += " /* comment\n*/\nx";
+    std::vector<std::string> files;
+    const simplecpp::TokenList tokens = makeTokenList(code.c_str(), files);
+    ASSERT_EQUALS("/* comment*/", tokens.cback()->previous->str());
+    ASSERT_EQUALS(3U, tokens.cback()->location.line);
+}
+
+static std::string preprocessStream(const std::string &code, simplecpp::OutputList *outputList, bool skipComments)
+{
+    std::vector<std::string> files;
+    simplecpp::FileDataCache cache;
+    std::istringstream istr(code);
+    simplecpp::TokenStream rawtokens(istr, files, std::string(), outputList, skipComments);
+    simplecpp::TokenList tokens2(files);
+    simplecpp::preprocess(tokens2, rawtokens, files, cache, simplecpp::DUI(), outputList);
+    simplecpp::cleanup(cache);
+    return tokens2.stringify();
+}
+
+static void preprocess_stream()
+{
+    // the file is lexed in chunks of lines, the code spans several chunks
+    std::string code = "#define A(x) x\n"
+                       "#define B (\n";
+    for (int i = 0; i < 1000; ++i) {
+        const std::string n = std::to_string(i);
+        if (i % 100 == 0)
+            code += "#if " + std::to_string(i / 100 % 3) + " // " + n + "\n";
+        else if (i % 100 == 50)
+            code += "#elif 1\n";
+        code += "int a" + n + " = A(" + n + ") + A\n"
+                "/* c */\n"
+                "(" + n + ");\n";
+        if (i % 7 == 0)
+            code += "A(1,\n2) B 1);\n";
+        if (i % 100 == 99)
+            code += "#else\nx;\n#endif\n";
+    }
+    code += "#define C(x) x\n"
+            "C(\n"
+            "#undef A\n"
+            "A(1))";
+
+    simplecpp::OutputList outputList1;
+    const std::string expected = preprocess(code.c_str(), &outputList1);
+    simplecpp::OutputList outputList2;
+    ASSERT_EQUALS(expected, preprocessStream(code, &outputList2, false));
+    ASSERT_EQUALS(toString(outputList1), toString(outputList2));
+    simplecpp::OutputList outputList3;
+    ASSERT_EQUALS(expected, preprocessStream(code, &outputList3, true));
+    ASSERT_EQUALS(toString(outputList1), toString(outputList3));
+}
+
+static void preprocess_stream_file()
+{
+    // the file is read into a buffer, CR LF and UTF-16 are handled like for a TokenList
+    std::string code;
+    for (int i = 0; i < 1000; ++i)
+        code += "#define A" + std::to_string(i) + " " + std::to_string(i) + "\r\n"
+                "int a = A" + std::to_string(i) + "; /* c */\r\n";
+    const std::string filename = "preprocess_stream_file.c";
+    for (const bool utf16 : {false, true}) {
+        {
+            std::ofstream f(filename, std::ios::binary);
+            if (utf16) {
+                f << "\xff\xfe";
+                for (const char c : code)
+                    f << c << '\0';
+            } else {
+                f << code;
+            }
+        }
+        std::vector<std::string> files;
+        simplecpp::FileDataCache cache;
+        simplecpp::OutputList outputList;
+        simplecpp::TokenStream rawtokens(filename, files, &outputList, true);
+        simplecpp::TokenList tokens2(files);
+        simplecpp::preprocess(tokens2, rawtokens, files, cache, simplecpp::DUI(), &outputList);
+        simplecpp::cleanup(cache);
+        ASSERT_EQUALS(preprocess(code.c_str()), tokens2.stringify());
+        ASSERT_EQUALS("", toString(outputList));
+    }
+    std::remove(filename.c_str());
+
+    std::vector<std::string> files;
+    simplecpp::OutputList outputList;
+    simplecpp::TokenStream rawtokens("preprocess_stream_missing.c", files, &outputList);
+    ASSERT_EQUALS(true, rawtokens.prepareAll());
+    ASSERT_EQUALS("", rawtokens.tokens().stringify());
+    ASSERT_EQUALS("file0,0,file_not_found,File is missing: preprocess_stream_missing.c\n", toString(outputList));
+}
+
+static void preprocess_stream_error()
+{
+    // a lexer error late in the file discards the output
+    std::string code;
+    for (int i = 0; i < 1000; ++i)
+        code += "int a" + std::to_string(i) + ";\n";
+    code += "#error x\n"
+            "\"abc";
+
+    simplecpp::OutputList outputList;
+    ASSERT_EQUALS("", preprocessStream(code, &outputList, false));
+    ASSERT_EQUALS("file0,1002,syntax_error,No pair for character (\"). Can't process file. File is either invalid or unicode, which is currently not supported.\n", toString(outputList));
+}
+
+static void readfile_parallel()
+{
+    // large enough to be split, the parts have lines that continue a comment,
+    // a raw string or a backslash continuation and #line directives
+    std::string code;
+    for (int i = 0; code.size() < 600000U; ++i) {
+        const std::string n = std::to_string(i);
+        code += "int a" + n + " = 1.\n"
+                "5e\n"
+                "+1 /* " + n + "\n"
+                "*/ ; const char *s" + n + " = R\"x(\n"
+                ")\"\n"
+                ")x\";\n"
+                "#define A" + n + " 1 \\\n"
+                "+ 2\n"
+                "x <<\n"
+                "= 1'000; // \\\n"
+                "comment\n";
+        if (i == 3000)
+            code += "#line 100000\n";
+    }
+    const std::string filename = "readfile_parallel.c";
+    {
+        std::ofstream f(filename, std::ios::binary);
+        f << code;
+    }
+
+    for (const bool skipComments : {false, true}) {
+        std::vector<std::string> files1;
+        simplecpp::OutputList outputList1;
+        const simplecpp::TokenList tokens1(filename, files1, &outputList1, skipComments);
+        std::vector<std::string> files4;
+        simplecpp::OutputList outputList4;
+        const simplecpp::TokenList tokens4(filename, files4, &outputList4, skipComments, 4);
+        ASSERT_EQUALS(tokens1.stringify(true), tokens4.stringify(true));
+        ASSERT_EQUALS(toString(outputList1), toString(outputList4));
+    }
+
+    std::remove(filename.c_str());
+}
+
 static void stringify1()
 {
     const char code_c[] = "#include \"A.h\"\n"
@@ -2939,6 +3350,21 @@ static void unicode()
         const char code[] = "\xff\xfe\x0d\x00\x0a\x00\x2f\x00\x2f\x00\x31\x00\x0d\x00\x0a\x00";
         ASSERT_EQUALS("\n//1", readfile(code, sizeof(code)));
     }
+    {
+        // non-ASCII characters are converted to UTF-8
+        const char code[] = "\xFF\xFE\x2f\x00\x2f\x00\xe9\x00\x3d\xd8\x00\xde\x0a\x00\x31\x00";
+        ASSERT_EQUALS("//\xC3\xA9\xF0\x9F\x98\x80\n1", readfile(code, sizeof(code)));
+    }
+    {
+        // outside comments and literals they are reported like in UTF-8 input, not as 0xff
+        const char code[] = "\xFF\xFE\x78\x00\x20\x00\xe9\x00";
+        simplecpp::OutputList outputList;
+        ASSERT_EQUALS("", readfile(code, sizeof(code), &outputList));
+        ASSERT_EQUALS("file0,1,unhandled_char_error,The code contains unhandled character(s) (character code=195). Neither unicode nor extended ascii is supported.\n", toString(outputList));
+        simplecpp::OutputList outputListUtf8;
+        readfile("x \xC3\xA9", &outputListUtf8);
+        ASSERT_EQUALS(toString(outputListUtf8), toString(outputList));
+    }
 }
 
 static void unicode_invalid()
@@ -3296,6 +3722,119 @@ static void token()
     ASSERT_TOKEN("+22", false, true, false);
 }
 
+static void internedString()
+{
+    const simplecpp::InternedString a("abc");
+    const simplecpp::InternedString b(std::string("ab") + "c");
+    const simplecpp::InternedString c("abd");
+    ASSERT_EQUALS(true, a == b);
+    ASSERT_EQUALS(true, a != c);
+    ASSERT_EQUALS(a.hash(), b.hash());
+    ASSERT_EQUALS("abc", a);
+    ASSERT_EQUALS(true, &a.str() == &b.str());
+
+    simplecpp::InternedString empty;
+    ASSERT_EQUALS(true, empty.empty());
+    ASSERT_EQUALS("", empty);
+    ASSERT_EQUALS(true, empty == simplecpp::InternedString(""));
+    empty = "abc";
+    ASSERT_EQUALS(true, empty == a);
+
+    // copied tokens share their text
+    const simplecpp::Token tok1("x", simplecpp::Location());
+    const simplecpp::Token tok2(tok1);
+    ASSERT_EQUALS(true, &tok1.str() == &tok2.str());
+
+    // Token::macro reads like a std::string
+    simplecpp::Token tok3("x", simplecpp::Location());
+    tok3.macro = "MACRO";
+    ASSERT_EQUALS(5U, tok3.macro.size());
+    ASSERT_EQUALS(0, std::strcmp(tok3.macro.c_str(), "MACRO"));
+    ASSERT_EQUALS('A', tok3.macro[1]);
+    ASSERT_EQUALS(2U, tok3.macro.find("CR"));
+    ASSERT_EQUALS("MAC", tok3.macro.substr(0, 3));
+    ASSERT_EQUALS(true, "MACRO" == tok3.macro);
+    ASSERT_EQUALS(true, std::string("X") != tok3.macro);
+    ASSERT_EQUALS("MACRO()", tok3.macro + "()");
+    std::ostringstream ostr;
+    ostr << tok3.macro;
+    ASSERT_EQUALS("MACRO", ostr.str());
+    const std::string macro = tok3.macro;
+    ASSERT_EQUALS(std::string(tok3.macro.begin(), tok3.macro.end()), macro);
+}
+
+static void keywords()
+{
+    ASSERT_EQUALS(simplecpp::KwNone, simplecpp::InternedString().keyword());
+    ASSERT_EQUALS(simplecpp::KwNone, simplecpp::InternedString("iff").keyword());
+    ASSERT_EQUALS(simplecpp::KwNone, simplecpp::InternedString("__FILE_").keyword());
+    ASSERT_EQUALS(simplecpp::KwIf, simplecpp::InternedString("if").keyword());
+    ASSERT_EQUALS(simplecpp::KwElse, simplecpp::InternedString("else").keyword());
+    ASSERT_EQUALS(simplecpp::KwElif, simplecpp::InternedString("elif").keyword());
+    ASSERT_EQUALS(simplecpp::KwError, simplecpp::InternedString("error").keyword());
+    ASSERT_EQUALS(simplecpp::KwEndif, simplecpp::InternedString("endif").keyword());
+    ASSERT_EQUALS(simplecpp::KwLine, simplecpp::InternedString("__LINE__").keyword());
+    ASSERT_EQUALS(simplecpp::KwHasInclude, simplecpp::InternedString("__has_include").keyword());
+    ASSERT_EQUALS(simplecpp::KwNotEq, simplecpp::Token("not_eq", simplecpp::Location()).keyword());
+}
+
+static void tokenPool()
+{
+    // tokens can be deleted on another thread than they were allocated on
+    std::vector<std::string> files;
+    simplecpp::TokenList list(files);
+    std::thread thread([&]() {
+        for (int i = 0; i < 2000; ++i)
+            list.push_back(new simplecpp::Token(std::to_string(i), simplecpp::Location()));
+    });
+    thread.join();
+    ASSERT_EQUALS("1999", list.cback()->str());
+    list.clear();
+    for (int i = 0; i < 2000; ++i)
+        list.push_back(new simplecpp::Token("x", simplecpp::Location()));
+    ASSERT_EQUALS("x", list.cfront()->str());
+
+    // more tokens than the pool keeps are deleted
+    for (int i = 0; i < 100000; ++i)
+        list.push_back(new simplecpp::Token("y", simplecpp::Location()));
+    list.clear();
+    ASSERT_EQUALS(true, simplecpp::Token::freeTokens() <= 64U * 256U + 511U);
+    list.push_back(new simplecpp::Token("z", simplecpp::Location()));
+    ASSERT_EQUALS("z", list.cfront()->str());
+}
+
+static void tokenListShared()
+{
+    std::vector<std::string> files;
+    simplecpp::TokenList list = makeTokenList("a b c", files);
+
+    // a copy shares the tokens until one of the lists is changed
+    simplecpp::TokenList copy(list);
+    ASSERT_EQUALS(true, copy.cfront() == list.cfront());
+    copy.push_back(new simplecpp::Token("d", copy.cback()->location));
+    ASSERT_EQUALS(true, copy.cfront() != list.cfront());
+    ASSERT_EQUALS("a b c", list.stringify());
+    ASSERT_EQUALS("a b c d", copy.stringify());
+
+    // the last list that refers to the tokens deletes them
+    {
+        simplecpp::TokenList copy2(files);
+        copy2 = list;
+        list.clear();
+        ASSERT_EQUALS("a b c", copy2.stringify());
+        copy2.deleteToken(copy2.front());
+        ASSERT_EQUALS("b c", copy2.stringify());
+    }
+
+    // a list that is not shared anymore gets its tokens back
+    list = copy;
+    copy.clear();
+    const simplecpp::Token * const front = list.cfront();
+    list.front()->setstr("e");
+    ASSERT_EQUALS(true, front == list.cfront());
+    ASSERT_EQUALS("e b c d", list.stringify());
+}
+
 static void preprocess_files()
 {
     {
@@ -3536,6 +4075,8 @@ int main(int argc, char **argv)
     TEST_CASE(combineOperators_increment);
     TEST_CASE(combineOperators_coloncolon);
     TEST_CASE(combineOperators_andequal);
+    TEST_CASE(combineOperators_shift);
+    TEST_CASE(combineOperators_adjacent);
     TEST_CASE(combineOperators_ellipsis);
 
     TEST_CASE(comment);
@@ -3560,6 +4101,10 @@ int main(int argc, char **argv)
     TEST_CASE(define11);
     TEST_CASE(define12);
     TEST_CASE(define13);
+    TEST_CASE(define14);
+    TEST_CASE(define15);
+    TEST_CASE(define16);
+    TEST_CASE(define17);
     TEST_CASE(define_invalid_1);
     TEST_CASE(define_invalid_2);
     TEST_CASE(define_define_1);
@@ -3668,6 +4213,8 @@ int main(int argc, char **argv)
     TEST_CASE(ifdef1);
     TEST_CASE(ifdef2);
     TEST_CASE(ifndef);
+    TEST_CASE(ifFalseBlock);
+    TEST_CASE(ifFalseBlockInclude);
     TEST_CASE(ifA);
     TEST_CASE(ifCharLiteral);
     TEST_CASE(ifDefined);
@@ -3699,6 +4246,7 @@ int main(int argc, char **argv)
     TEST_CASE(location9);
     TEST_CASE(location10);
     TEST_CASE(location11);
+    TEST_CASE(locationFiles);
 
     TEST_CASE(missingHeader1);
     TEST_CASE(missingHeader2);
@@ -3721,6 +4269,7 @@ int main(int argc, char **argv)
     TEST_CASE(include7); // #include MACRO
     TEST_CASE(include8); // #include MACRO(X)
     TEST_CASE(include9); // #include MACRO
+    TEST_CASE(include10); // #include directory
 
     TEST_CASE(multiline1);
     TEST_CASE(multiline2);
@@ -3742,6 +4291,14 @@ int main(int argc, char **argv)
     TEST_CASE(readfile_unhandled_chars);
     TEST_CASE(readfile_error);
     TEST_CASE(readfile_file_not_found);
+    TEST_CASE(readfile_file);
+    TEST_CASE(readfile_directory);
+    TEST_CASE(readfile_skip_comments);
+    TEST_CASE(readfile_long_directive);
+    TEST_CASE(readfile_parallel);
+    TEST_CASE(preprocess_stream);
+    TEST_CASE(preprocess_stream_file);
+    TEST_CASE(preprocess_stream_error);
 
     TEST_CASE(stringify1);
 
@@ -3780,6 +4337,10 @@ int main(int argc, char **argv)
     TEST_CASE(stdValid);
 
     TEST_CASE(token);
+    TEST_CASE(internedString);
+    TEST_CASE(keywords);
+    TEST_CASE(tokenPool);
+    TEST_CASE(tokenListShared);
 
     TEST_CASE(preprocess_files);
 